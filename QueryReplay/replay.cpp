@@ -0,0 +1,336 @@
+// replay.cpp : Replays a timestamped query log against the C API, and reports latency by query class.
+//
+// Usage: QueryReplay <corpus> <query log> [--closed] [--threads N] [--speed X] [--huge-pages 0|1|2] [--per-node] [--compressed]
+//              [--lsh B R] [--flags N]
+//
+// corpus     One row per line. Columns are separated by tabs, the first column being the master key.
+// query log  One operation per line, as tab separated columns:
+//            <ms> search <query> [threshold] [limit]
+//            <ms> index      indexes another copy of the corpus
+//            <ms> dispose    disposes the oldest copy indexed by the log
+//
+// In the default open loop, each operation is started at its timestamp (divided by --speed) whether or not
+// the previous ones have completed, and its latency includes the time it waited for a thread.
+// In the closed loop (--closed), each thread starts the next operation as soon as its previous one completes.
+// --huge-pages and --per-node are passed to setAllocation before the corpus is indexed.
+// --compressed front-codes the strings of the main library with setStringPool once it is indexed, and reports the bytes saved.
+// --lsh builds B bands of R rows with buildLsh once the main library is indexed, and --flags passes N to searchEx as SearchFlags,
+// e.g. 1 to let the planner pick the LSH bands, or 9 to search them whenever the query has n-grams.
+#include "dllmain.cpp"
+#include <algorithm>
+#include <chrono>
+#include <condition_variable>
+#include <cstdio>
+#include <deque>
+#include <fstream>
+#include <iostream>
+#include <sstream>
+#include <string>
+#include <thread>
+#include <vector>
+
+using Clock = std::chrono::steady_clock;
+
+//the classes latencies are reported for
+enum QueryClass
+{
+	Wildcard, Tiny, Short, Long, Index, Dispose, ClassCount
+};
+
+const char* className[ClassCount] = { "wildcard", "1-3 chars", "short", "long", "index", "dispose" };
+
+struct Operation
+{
+	double at;
+	QueryClass kind;
+	std::string query;
+	float threshold;
+	uint32_t limit;
+};
+
+/*!
+Classifies a query by its length once normalised, as the paths of _search under SearchFixedPlan
+@param query The query string
+*/
+QueryClass classify(const std::string& query)
+{
+	//an empty library normalises the queries with the default validChar set, as the libraries of the replay do
+	static const StringSearch::StringIndex normalizer(nullptr, 0, 1, nullptr);
+	auto prepared = normalizer.prepare(query.c_str());
+	auto& normalized = prepared.text;
+	//queries of invalid characters only, e.g. "--", are searched as empty ones
+	if (prepared.wildcard || normalized.empty())
+		return Wildcard;
+	if (normalized.size() <= 3)
+		return Tiny;
+	//queries shorter than 9 characters also scan the short strings
+	if (normalized.size() < 9)
+		return Short;
+	return Long;
+}
+
+/*!
+Splits a line by tabs
+@param line The line to be split
+*/
+std::vector<std::string> splitTabs(const std::string& line)
+{
+	std::vector<std::string> columns;
+	std::stringstream stream(line);
+	std::string column;
+	while (std::getline(stream, column, '\t'))
+		columns.push_back(column);
+	return columns;
+}
+
+/*!
+Reads the corpus as a flattened array of rows, as expected by indexN
+@param path The corpus file
+@param rowSize Output the number of columns of the widest row
+*/
+std::vector<std::string> readCorpus(const char* path, uint16_t& rowSize)
+{
+	std::ifstream in(path);
+	std::vector<std::vector<std::string>> rows;
+	std::string line;
+	rowSize = 1;
+	while (std::getline(in, line))
+	{
+		if (!line.empty() && line.back() == '\r')
+			line.pop_back();
+		if (line.empty())
+			continue;
+		rows.push_back(splitTabs(line));
+		rowSize = std::max(rowSize, (uint16_t)rows.back().size());
+	}
+	std::vector<std::string> words;
+	for (auto& row : rows)
+	{
+		row.resize(rowSize);
+		words.insert(words.end(), row.begin(), row.end());
+	}
+	return words;
+}
+
+/*!
+Reads the query log
+@param path The query log file
+*/
+std::vector<Operation> readLog(const char* path)
+{
+	std::ifstream in(path);
+	std::vector<Operation> log;
+	std::string line;
+	while (std::getline(in, line))
+	{
+		if (!line.empty() && line.back() == '\r')
+			line.pop_back();
+		auto columns = splitTabs(line);
+		if (columns.size() < 2)
+			continue;
+		Operation op = { std::stod(columns[0]), Wildcard, "", 0.5f, 100 };
+		if (columns[1] == "index")
+			op.kind = Index;
+		else if (columns[1] == "dispose")
+			op.kind = Dispose;
+		else if (columns[1] == "search")
+		{
+			if (columns.size() > 2)
+				op.query = columns[2];
+			if (columns.size() > 3)
+				op.threshold = std::stof(columns[3]);
+			if (columns.size() > 4)
+				op.limit = (uint32_t)std::stoul(columns[4]);
+			op.kind = classify(op.query);
+		}
+		else
+			continue;
+		log.push_back(op);
+	}
+	return log;
+}
+
+int main(int argc, char** argv)
+{
+	if (argc < 3)
+	{
+		std::cerr << "Usage: QueryReplay <corpus> <query log> [--closed] [--threads N] [--speed X] [--huge-pages 0|1|2] [--per-node] [--compressed]"
+			" [--lsh B R] [--flags N]" << std::endl;
+		return 1;
+	}
+	bool closedLoop = false;
+	size_t threads = 8;
+	double speed = 1.0;
+	uint8_t hugePages = 0;
+	bool perNode = false;
+	bool compressed = false;
+	uint16_t lshBands = 0, lshRows = 0;
+	uint32_t flags = SearchExact;
+	for (int i = 3; i < argc; i++)
+	{
+		std::string arg(argv[i]);
+		if (arg == "--closed")
+			closedLoop = true;
+		else if (arg == "--threads" && i + 1 < argc)
+			threads = std::max(std::stoul(argv[++i]), 1ul);
+		else if (arg == "--speed" && i + 1 < argc)
+			speed = std::stod(argv[++i]);
+		else if (arg == "--huge-pages" && i + 1 < argc)
+			hugePages = (uint8_t)std::stoul(argv[++i]);
+		else if (arg == "--per-node")
+			perNode = true;
+		else if (arg == "--compressed")
+			compressed = true;
+		else if (arg == "--lsh" && i + 2 < argc)
+		{
+			lshBands = (uint16_t)std::stoul(argv[++i]);
+			lshRows = (uint16_t)std::stoul(argv[++i]);
+		}
+		else if (arg == "--flags" && i + 1 < argc)
+			flags = (uint32_t)std::stoul(argv[++i]);
+	}
+
+	uint16_t rowSize = 1;
+	auto corpus = readCorpus(argv[1], rowSize);
+	std::vector<char*> words;
+	for (auto& word : corpus)
+		words.push_back(word.empty() ? nullptr : const_cast<char*>(word.c_str()));
+	auto log = readLog(argv[2]);
+	if (words.empty() || log.empty())
+	{
+		std::cerr << "Empty corpus or query log" << std::endl;
+		return 1;
+	}
+
+	setAllocation(hugePages, perNode);
+	auto indexStart = Clock::now();
+	auto handle = indexN(words.data(), words.size(), rowSize, NULL);
+	std::cout << "Indexed " << words.size() / rowSize << " rows in "
+		<< std::chrono::duration<double, std::milli>(Clock::now() - indexStart).count() << " ms" << std::endl;
+	if (compressed)
+	{
+		setStringPool(handle, true);
+		IndexStats stats;
+		getIndexStats(handle, &stats);
+		printf("Compressed strings: %.1f KB, %.1f KB saved\n", stats.stringLibBytes / 1024.0, stats.stringPoolSavedBytes / 1024.0);
+	}
+	if (lshBands)
+		buildLsh(handle, lshBands, lshRows);
+
+	//copies indexed by the log, searched in turn with the main library
+	std::mutex churnLock;
+	std::deque<uint32_t> churned;
+	std::vector<std::vector<double>> latencies(ClassCount);
+	std::mutex latencyLock;
+
+	auto run = [&](const Operation& op, Clock::time_point scheduled) {
+		if (op.kind == Index)
+		{
+			auto copy = indexN(words.data(), words.size(), rowSize, NULL);
+			std::lock_guard<std::mutex> guard(churnLock);
+			churned.push_back(copy);
+		}
+		else if (op.kind == Dispose)
+		{
+			uint32_t copy = 0;
+			{
+				std::lock_guard<std::mutex> guard(churnLock);
+				if (!churned.empty())
+				{
+					copy = churned.front();
+					churned.pop_front();
+				}
+			}
+			dispose(copy);
+		}
+		else
+		{
+			char** results = nullptr;
+			searchEx(handle, op.query.c_str(), &results, nullptr, op.threshold, op.limit, flags);
+			release(handle, results, nullptr);
+		}
+		auto latency = std::chrono::duration<double, std::micro>(Clock::now() - scheduled).count();
+		std::lock_guard<std::mutex> guard(latencyLock);
+		latencies[op.kind].push_back(latency);
+	};
+
+	uint64_t waitBefore = 0, contendedBefore = 0;
+	getLockStats(&waitBefore, &contendedBefore);
+	auto start = Clock::now();
+	std::vector<std::thread> workers;
+	std::atomic<size_t> next{ 0 };
+	//the dispatcher releases each operation at its timestamp, to be run by the first idle worker
+	std::mutex queueLock;
+	std::condition_variable ready;
+	std::deque<std::pair<const Operation*, Clock::time_point>> queue;
+	bool done = false;
+	if (closedLoop)
+	{
+		for (size_t t = 0; t < threads; t++)
+			workers.emplace_back([&]() {
+				for (size_t i = next++; i < log.size(); i = next++)
+					run(log[i], Clock::now());
+			});
+	}
+	else
+	{
+		for (size_t t = 0; t < threads; t++)
+			workers.emplace_back([&]() {
+				for (;;)
+				{
+					std::unique_lock<std::mutex> guard(queueLock);
+					ready.wait(guard, [&]() { return done || !queue.empty(); });
+					if (queue.empty())
+						return;
+					auto item = queue.front();
+					queue.pop_front();
+					guard.unlock();
+					run(*item.first, item.second);
+				}
+			});
+		auto origin = log.front().at;
+		for (auto& op : log)
+		{
+			auto scheduled = start + std::chrono::duration_cast<Clock::duration>(
+				std::chrono::duration<double, std::milli>((op.at - origin) / speed));
+			std::this_thread::sleep_until(scheduled);
+			{
+				std::lock_guard<std::mutex> guard(queueLock);
+				queue.emplace_back(&op, scheduled);
+			}
+			ready.notify_one();
+		}
+		{
+			std::lock_guard<std::mutex> guard(queueLock);
+			done = true;
+		}
+		ready.notify_all();
+	}
+	for (auto& worker : workers)
+		worker.join();
+	auto elapsed = std::chrono::duration<double>(Clock::now() - start).count();
+	uint64_t waitAfter = 0, contendedAfter = 0;
+	getLockStats(&waitAfter, &contendedAfter);
+
+	printf("%s loop, %zu threads: %zu operations in %.3f s, %.1f ops/s\n", closedLoop ? "Closed" : "Open", threads,
+		log.size(), elapsed, log.size() / elapsed);
+	printf("%-10s %10s %12s %12s %12s %12s\n", "class", "count", "p50 us", "p90 us", "p99 us", "max us");
+	for (int c = 0; c < ClassCount; c++)
+	{
+		auto& samples = latencies[c];
+		if (samples.empty())
+			continue;
+		std::sort(samples.begin(), samples.end());
+		auto percentile = [&](double p) { return samples[std::min(samples.size() - 1, (size_t)(p * samples.size()))]; };
+		printf("%-10s %10zu %12.1f %12.1f %12.1f %12.1f\n", className[c], samples.size(),
+			percentile(0.5), percentile(0.9), percentile(0.99), samples.back());
+	}
+	auto contended = contendedAfter - contendedBefore;
+	printf("Lock wait: %.3f ms in %llu contended acquisitions, %.1f us per operation\n", (waitAfter - waitBefore) / 1e6,
+		(unsigned long long)contended, (waitAfter - waitBefore) / 1e3 / log.size());
+
+	for (auto copy : churned)
+		dispose(copy);
+	dispose(handle);
+	return 0;
+}
@@ -1,19 +1,758 @@
 #include "pch.h"
 #include "nGramSearch.h"
 #include "dllmain.cpp"
+#include <filesystem>
+#include <map>
+#include <set>
+#include <random>
 
-int handle = 0;
-void SetUp() {
-	char** words = new char*[7]{
-		"LWMS", "LWM", "LWMA", "LWYY", "L", "I", "GHRSDGSDGS Egdsrtg g"
-	};
-	handle = indexN(words, 7, 7, NULL);
-}
+//a library of 7 master keys, indexed before each test of the fixture and disposed after it
+class StringFixture : public ::testing::Test
+{
+protected:
+	void SetUp() override
+	{
+		char* words[7] = {
+			"LWMS", "LWM", "LWMA", "LWYY", "L", "I", "GHRSDGSDGS Egdsrtg g"
+		};
+		handle = indexN(words, 7, 1, NULL);
+	}
+
+	void TearDown() override
+	{
+		dispose(handle);
+	}
 
-TEST(StringTest, test_for_search) {
+	uint32_t handle = 0;
+};
+
+TEST_F(StringFixture, test_for_search) {
 	EXPECT_EQ(7, getSize(handle));
 	EXPECT_EQ(16, getLibSize(handle));
-	char*** result = nullptr;
-	auto size = search(handle, "LWMS", result, 0.5f, (numeric_limits<int>::max)());
+	char** result = nullptr;
+	auto size = search(handle, "LWMS", &result, 0.5f, (numeric_limits<int>::max)());
 	EXPECT_EQ(4, size);
-}
\ No newline at end of file
+	release(handle, result, nullptr);
+}
+
+TEST(StringTest, test_for_length_pruning) {
+	char** words = new char*[3]{
+		"ABCDEFGHIJKLMNOP", "ABCDEFG", "XYZABCDEFGHIJKLMNOPQRS"
+	};
+	auto lib = indexN(words, 3, 1, NULL);
+	char** result = nullptr;
+	auto size = search(lib, "ABCDEFGHIJKLMNOP", &result, 0.9f, 10);
+	EXPECT_EQ(2, size);
+	release(lib, result, nullptr);
+
+	SearchStats stats;
+	getSearchStats(lib, &stats);
+	EXPECT_EQ(1, stats.queries);
+	//"ABCDEFG" holds 5 of the 14 query grams, so its postings are skipped
+	EXPECT_EQ(5, stats.postingsSkipped);
+	EXPECT_EQ(28, stats.postingsVisited);
+
+	size = search(lib, "ABCDEFGHIJKLMNOP", &result, 0.3f, 10);
+	EXPECT_EQ(3, size);
+	release(lib, result, nullptr);
+	dispose(lib);
+	delete[] words;
+}
+
+TEST(StringTest, test_for_stop_grams) {
+	char** words = new char*[5]{
+		"RUNNING", "SINGING", "BRINGING", "KINGSTON", "ZEPPELIN"
+	};
+	auto lib = indexN(words, 5, 1, NULL);
+	char** result = nullptr;
+	float* scores = nullptr;
+	auto size = search(lib, "KINGSTON", &result, 0.1f, 10);
+	EXPECT_EQ(4, size);
+	release(lib, result, nullptr);
+
+	//"ING" is found in 4 of the 5 strings
+	setScoring(lib, 0, 0.5f);
+	size = search(lib, "KINGSTON", &result, 0.1f, 10);
+	EXPECT_EQ(1, size);
+	release(lib, result, nullptr);
+	SearchStats stats;
+	getSearchStats(lib, &stats);
+	EXPECT_EQ(1, stats.stopGramsSkipped);
+	EXPECT_EQ(4, stats.stopPostingsSkipped);
+
+	//a hit on "ING" only is worth less than 1 of the 6 query grams
+	setScoring(lib, 1, 1.0f);
+	size = score(lib, "KINGSTON", &result, &scores, 0.0f, 10);
+	EXPECT_EQ(4, size);
+	EXPECT_STREQ("KINGSTON", result[0]);
+	EXPECT_LT(scores[1], 1.0f / 6);
+	release(lib, result, scores);
+	dispose(lib);
+	delete[] words;
+}
+
+TEST(StringTest, test_for_lsh_recall) {
+	//a synthetic corpus of product-like names, each query being a corpus string with a typo
+	std::mt19937 rng(42);
+	const char* parts[] = { "STEEL", "BOLT", "WASHER", "NUT", "HEX", "FLANGE", "SCREW", "ZINC", "BRASS", "NYLON",
+		"SPRING", "LOCK", "CAP", "SOCKET", "PAN", "HEAD", "THREAD", "ROD", "PIN", "RIVET" };
+	std::vector<std::string> corpus;
+	for (int i = 0; i < 3000; i++)
+	{
+		std::string str;
+		for (int j = 0; j < 3; j++)
+			str += std::string(parts[rng() % 20]) + " ";
+		corpus.push_back(str + std::to_string(rng() % 1000));
+	}
+	std::vector<char*> words;
+	for (auto& str : corpus)
+		words.push_back(const_cast<char*>(str.c_str()));
+	auto lib = indexN(words.data(), words.size(), 1, NULL);
+	buildLsh(lib, 24, 3);
+
+	const uint32_t limit = 10;
+	size_t found = 0, expected = 0;
+	for (int i = 0; i < 200; i++)
+	{
+		std::string query = corpus[rng() % corpus.size()];
+		query[rng() % query.size()] = 'Q';
+		char** exact = nullptr;
+		char** approx = nullptr;
+		auto exactSize = searchEx(lib, query.c_str(), &exact, nullptr, 0.7f, limit, SearchExact | SearchFixedPlan);
+		auto approxSize = searchEx(lib, query.c_str(), &approx, nullptr, 0.7f, limit, SearchApproximate | SearchFixedPlan);
+
+		std::unordered_set<std::string> approxSet(approx, approx + approxSize);
+		expected += exactSize;
+		for (uint32_t j = 0; j < exactSize; j++)
+			found += approxSet.count(exact[j]);
+		release(lib, exact, nullptr);
+		release(lib, approx, nullptr);
+	}
+	EXPECT_GT((double)found / expected, 0.8);
+	dispose(lib);
+}
+
+TEST(StringTest, test_for_typeahead_session) {
+	char** words = new char*[8]{
+		"APPLE", "APPLIANCE", "APP STORE", "PINEAPPLE", "MAPLE", "APPLE PIE", "APPLAUSE", "ZAP"
+	};
+	auto lib = indexN(words, 8, 1, NULL);
+	auto session = openSession(lib);
+	EXPECT_NE(0, session);
+	std::string typed;
+	for (auto keys : { "A", "P", "P", "L", "E", " ", "P", "I", "E" })
+	{
+		typed += keys;
+		char** result = nullptr;
+		float* scores = nullptr;
+		auto size = extendQuery(session, keys, &result, &scores, 0.3f, 0);
+		std::map<std::string, float> incremental;
+		for (uint32_t i = 0; i < size; i++)
+			incremental[result[i]] = scores[i];
+		release(lib, result, scores);
+
+		size = score(lib, typed.c_str(), &result, &scores, 0.3f, 0);
+		std::map<std::string, float> fresh;
+		for (uint32_t i = 0; i < size; i++)
+			fresh[result[i]] = scores[i];
+		release(lib, result, scores);
+		EXPECT_EQ(fresh, incremental) << typed;
+	}
+	closeSession(session);
+	dispose(lib);
+	delete[] words;
+}
+
+TEST(StringTest, test_for_session_after_dispose) {
+	char** words = new char*[3]{ "APPLE", "APPLIANCE", "MAPLE" };
+	auto lib = indexN(words, 3, 1, NULL);
+	auto session = openSession(lib);
+	char** result = nullptr;
+	float* scores = nullptr;
+	auto size = extendQuery(session, "APPL", &result, &scores, 0.3f, 0);
+	EXPECT_GT(size, 0);
+	release(lib, result, scores);
+
+	//the next library takes the handle, and likely the address, of the disposed one
+	dispose(lib);
+	char** others = new char*[2]{ "ZZ", "QQQQQQ" };
+	EXPECT_EQ(lib, indexN(others, 2, 1, NULL));
+	size = extendQuery(session, "E", &result, &scores, 0.3f, 0);
+	std::map<std::string, float> incremental;
+	for (uint32_t i = 0; i < size; i++)
+		incremental[result[i]] = scores[i];
+	release(lib, result, scores);
+
+	size = score(lib, "APPLE", &result, &scores, 0.3f, 0);
+	std::map<std::string, float> fresh;
+	for (uint32_t i = 0; i < size; i++)
+		fresh[result[i]] = scores[i];
+	release(lib, result, scores);
+	EXPECT_EQ(fresh, incremental);
+	EXPECT_TRUE(incremental.empty());
+	closeSession(session);
+	dispose(lib);
+	delete[] words;
+	delete[] others;
+}
+
+TEST(StringTest, test_for_memory_budget) {
+	char** words = new char*[4]{
+		"APPLE", "PINEAPPLE", "APPLE PIE", "MAPLE SYRUP"
+	};
+	auto first = indexN(words, 4, 1, NULL);
+	char** result = nullptr;
+	auto size = search(first, "APPLE", &result, 0.5f, 0);
+	release(first, result, nullptr);
+	auto footprint = getMemoryUsage(first);
+	EXPECT_GT(footprint, 0);
+
+	//room for one library only
+	setMemoryBudget(footprint + footprint / 2, std::filesystem::temp_directory_path().string().c_str());
+	auto second = indexN(words, 4, 1, NULL);
+	EXPECT_FALSE(isResident(first));
+	EXPECT_TRUE(isResident(second));
+	EXPECT_EQ(4, getSize(first));
+	EXPECT_EQ(getLibSize(second), getLibSize(first));
+	EXPECT_FALSE(isResident(first));
+
+	//the next search reloads the cold library, and evicts the other one
+	EXPECT_EQ(size, search(first, "APPLE", &result, 0.5f, 0));
+	EXPECT_TRUE(isResident(first));
+	EXPECT_FALSE(isResident(second));
+	EXPECT_STREQ("APPLE", result[0]);
+	release(first, result, nullptr);
+	//the counters carry on across the eviction
+	SearchStats stats;
+	getSearchStats(first, &stats);
+	EXPECT_EQ(2, stats.queries);
+
+	//a library with nothing indexed hands out no result array, and is thus not kept resident by the search
+	auto empty = indexN(nullptr, 0, 1, NULL);
+	result = words;
+	EXPECT_EQ(0, search(empty, "APPLE", &result, 0.5f, 0));
+	EXPECT_EQ(nullptr, result);
+	release(empty, result, nullptr);
+
+	//a snapshot that fails to load is dropped, and not parsed again by the next calls
+	auto snapshot = std::filesystem::temp_directory_path() / ("nGramSearch_" + std::to_string(second) + ".snapshot");
+	EXPECT_TRUE(std::filesystem::exists(snapshot));
+	std::filesystem::resize_file(snapshot, 16);
+	EXPECT_EQ(0, search(second, "APPLE", &result, 0.5f, 0));
+	EXPECT_FALSE(std::filesystem::exists(snapshot));
+	EXPECT_EQ(0, search(second, "APPLE", &result, 0.5f, 0));
+	EXPECT_FALSE(isResident(second));
+
+	setMemoryBudget(0, nullptr);
+	dispose(first);
+	dispose(second);
+	dispose(empty);
+	delete[] words;
+}
+
+TEST(StringTest, test_for_index_stats) {
+	char** words = new char*[6]{
+		"RUNNING", "SINGING", "BRINGING", "KINGSTON", "ZEPPELIN", "KING"
+	};
+	auto lib = indexN(words, 6, 1, NULL);
+	IndexStats stats;
+	getIndexStats(lib, &stats);
+	EXPECT_EQ(6, stats.strings);
+	EXPECT_EQ(1, stats.shortStrings);
+	EXPECT_EQ(5, stats.longStrings);
+	EXPECT_DOUBLE_EQ(1.0, stats.keysPerString);
+	EXPECT_EQ(getLibSize(lib), stats.grams);
+	EXPECT_STREQ("ING", stats.heaviestGrams[0].gram);
+	EXPECT_EQ(4, stats.heaviestGrams[0].postings);
+	EXPECT_EQ(4, stats.postingsMax);
+	EXPECT_EQ(1, stats.postingsP50);
+	EXPECT_EQ(getMemoryUsage(lib), stats.totalBytes);
+	EXPECT_EQ(stats.totalBytes, stats.stringLibBytes + stats.postingBytes + stats.wordMapBytes + stats.wordWeightBytes
+		+ stats.lshBytes + stats.otherBytes + stats.allocatorOverheadBytes);
+
+	//the LSH bands are accounted for when they are built
+	buildLsh(lib, 4, 2);
+	IndexStats withLsh;
+	getIndexStats(lib, &withLsh);
+	EXPECT_GT(withLsh.lshBytes, 0);
+	EXPECT_EQ(stats.totalBytes + withLsh.lshBytes + withLsh.allocatorOverheadBytes - stats.allocatorOverheadBytes, withLsh.totalBytes);
+	EXPECT_EQ(getMemoryUsage(lib), withLsh.totalBytes);
+	dispose(lib);
+	delete[] words;
+}
+
+TEST(StringTest, test_for_allocation) {
+	char** words = new char*[5]{
+		"RUNNING", "SINGING", "BRINGING", "KINGSTON", "ZEPPELIN"
+	};
+	auto lib = indexN(words, 5, 1, NULL);
+	char** result = nullptr;
+	float* scores = nullptr;
+	auto size = score(lib, "KINGSTON", &result, &scores, 0.1f, 10);
+	std::vector<std::pair<std::string, float>> expected;
+	for (uint32_t i = 0; i < size; i++)
+		expected.emplace_back(result[i], scores[i]);
+	release(lib, result, scores);
+
+	//the posting lists are moved, and the searches are unchanged
+	setAllocation(HugePagesTransparent, true);
+	IndexStats stats;
+	getIndexStats(lib, &stats);
+	EXPECT_EQ(NumaTopology::get().nodes(), stats.postingReplicas);
+	EXPECT_EQ(getMemoryUsage(lib), stats.totalBytes);
+	auto indexedLater = indexN(words, 5, 1, NULL);
+	for (auto handle : { lib, indexedLater })
+	{
+		EXPECT_EQ(size, score(handle, "KINGSTON", &result, &scores, 0.1f, 10));
+		for (uint32_t i = 0; i < size; i++)
+		{
+			EXPECT_STREQ(expected[i].first.c_str(), result[i]);
+			EXPECT_FLOAT_EQ(expected[i].second, scores[i]);
+		}
+		release(handle, result, scores);
+	}
+
+	setAllocation(HugePagesOff, false);
+	getIndexStats(lib, &stats);
+	EXPECT_EQ(1, stats.postingReplicas);
+	EXPECT_EQ(0, stats.hugePageReplicas);
+	dispose(lib);
+	dispose(indexedLater);
+	delete[] words;
+}
+
+TEST(StringTest, test_for_packed_short_match) {
+	std::mt19937 random(7);
+	std::vector<std::string> strings;
+	for (int i = 0; i < 1000; i++)
+	{
+		std::string str(1 + random() % PackedStrings::width, ' ');
+		for (auto& ch : str)
+			ch = "ABCDE"[random() % 5];
+		strings.push_back(str);
+	}
+	std::vector<const std::string*> pointers;
+	for (auto& str : strings)
+		pointers.push_back(&str);
+	PackedStrings packed;
+	packed.pack(pointers);
+
+	//edit distance of the query to the closest substring of the source
+	auto distance = [](const std::string& query, const std::string& source) {
+		std::vector<size_t> row(source.size() + 1, 0);
+		for (size_t q = 0; q < query.size(); q++)
+		{
+			auto diagonal = row[0];
+			row[0] = q + 1;
+			for (size_t s = 0; s < source.size(); s++)
+			{
+				auto above = row[s + 1];
+				row[s + 1] = std::min(std::min(above + 1, row[s] + 1), diagonal + (query[q] != source[s]));
+				diagonal = above;
+			}
+		}
+		return *std::min_element(row.begin(), row.end());
+	};
+	std::vector<PackedStrings::Kernel> kernels = { nullptr, &PackedStrings::matchScalar };
+#if defined(PACKED_X86)
+	kernels.push_back(&PackedStrings::matchSse2);
+	if (PackedStrings::hasAvx2())
+		kernels.push_back(&PackedStrings::matchAvx2);
+#endif
+	std::vector<uint8_t> misMatch((strings.size() + PackedStrings::lanes - 1) / PackedStrings::lanes * PackedStrings::lanes);
+	for (std::string query : { "A", "AB", "ABCDE", "EDCBAEDC" })
+		for (auto kernel : kernels)
+		{
+			packed.match(query, misMatch.data(), kernel);
+			for (size_t i = 0; i < strings.size(); i++)
+				ASSERT_EQ(distance(query, strings[i]), misMatch[i]) << query << " " << strings[i];
+		}
+}
+
+TEST(StringTest, test_for_dense_postings) {
+	//the slices of each kernel add up to the number of bitmaps set at each position
+	std::mt19937 random(11);
+	const size_t words = 37;
+	std::vector<std::vector<uint32_t>> bitmaps(20, std::vector<uint32_t>(words));
+	std::vector<const uint32_t*> pointers;
+	for (auto& bitmap : bitmaps)
+	{
+		for (auto& word : bitmap)
+			word = (uint32_t)random() & (uint32_t)random();
+		pointers.push_back(bitmap.data());
+	}
+	std::vector<BitSlicedCounter::Kernel> kernels = { nullptr, &BitSlicedCounter::countScalar };
+#if defined(PACKED_X86)
+	kernels.push_back(&BitSlicedCounter::countSse2);
+	if (PackedStrings::hasAvx2())
+		kernels.push_back(&BitSlicedCounter::countAvx2);
+#endif
+	auto bits = BitSlicedCounter::width(pointers.size());
+	std::vector<uint32_t> sliced(bits * (words - 3));
+	for (auto kernel : kernels)
+	{
+		BitSlicedCounter::count(pointers.data(), pointers.size(), 3, words - 3, sliced.data(), kernel);
+		for (size_t w = 3; w < words; w++)
+			for (size_t bit = 0; bit < 32; bit++)
+			{
+				uint32_t expected = 0, counted = 0;
+				for (auto& bitmap : bitmaps)
+					expected += (bitmap[w] >> bit) & 1;
+				for (size_t k = 0; k < bits; k++)
+					counted |= ((sliced[k * (words - 3) + w - 3] >> bit) & 1) << k;
+				ASSERT_EQ(expected, counted);
+			}
+	}
+
+	//the same strings score the same whether their grams are dense, or diluted by other strings to sparse ones
+	std::vector<std::string> targets;
+	for (int i = 0; i < 40; i++)
+		targets.push_back("APPLE " + std::string("PIE CRUMBLE TART", i % 16) + std::to_string(i));
+	std::vector<std::string> padding;
+	for (int i = 0; i < 2000; i++)
+		padding.push_back("QZ" + std::to_string(i) + "QZ");
+	std::vector<char*> denseWords, sparseWords;
+	for (auto& str : targets)
+	{
+		denseWords.push_back(const_cast<char*>(str.c_str()));
+		sparseWords.push_back(const_cast<char*>(str.c_str()));
+	}
+	for (auto& str : padding)
+		sparseWords.push_back(const_cast<char*>(str.c_str()));
+	auto denseLib = indexN(denseWords.data(), denseWords.size(), 1, NULL);
+	auto sparseLib = indexN(sparseWords.data(), sparseWords.size(), 1, NULL);
+	IndexStats stats;
+	getIndexStats(denseLib, &stats);
+	EXPECT_GT(stats.denseGrams, 0);
+
+	for (const char* query : { "APPLE PIE", "APPLE CRUMBLE TART", "PIE 7" })
+	{
+		char** denseResult = nullptr;
+		float* denseScores = nullptr;
+		char** sparseResult = nullptr;
+		float* sparseScores = nullptr;
+		auto denseSize = score(denseLib, query, &denseResult, &denseScores, 0.3f, 0);
+		auto sparseSize = score(sparseLib, query, &sparseResult, &sparseScores, 0.3f, 0);
+		std::map<std::string, float> denseFound, sparseFound;
+		for (uint32_t i = 0; i < denseSize; i++)
+			denseFound[denseResult[i]] = denseScores[i];
+		for (uint32_t i = 0; i < sparseSize; i++)
+			sparseFound[sparseResult[i]] = sparseScores[i];
+		EXPECT_FALSE(denseFound.empty()) << query;
+		EXPECT_EQ(sparseFound, denseFound) << query;
+		release(denseLib, denseResult, denseScores);
+		release(sparseLib, sparseResult, sparseScores);
+	}
+	dispose(denseLib);
+	dispose(sparseLib);
+}
+
+TEST(StringTest, test_for_exact_match) {
+	char** words = new char*[6]{
+		"apple", "malus", "Apple Pie", nullptr, "pineapple", nullptr
+	};
+	auto lib = indexN(words, 6, 2, NULL);
+	char** result = nullptr;
+	float* scores = nullptr;
+
+	//the exact match is returned alone, without the fuzzy search
+	auto size = searchEx(lib, " apple!", &result, &scores, 0.5f, 10, SearchExactFirst);
+	EXPECT_EQ(1, size);
+	EXPECT_STREQ("apple", result[0]);
+	EXPECT_FLOAT_EQ(100, scores[0]);
+	release(lib, result, scores);
+
+	//or ahead of the fuzzy matches
+	size = searchEx(lib, "APPLE", &result, &scores, 0.5f, 10, 0);
+	EXPECT_EQ(3, size);
+	EXPECT_STREQ("apple", result[0]);
+	EXPECT_FLOAT_EQ(100, scores[0]);
+	EXPECT_LT(scores[1], 100);
+	release(lib, result, scores);
+
+	//a query equal to another word of the row is not an exact match of the key
+	size = searchEx(lib, "MALUS", &result, &scores, 0.5f, 10, SearchExactFirst);
+	EXPECT_EQ(1, size);
+	EXPECT_STREQ("apple", result[0]);
+	EXPECT_FLOAT_EQ(1, scores[0]);
+	release(lib, result, scores);
+	dispose(lib);
+	delete[] words;
+}
+
+TEST(StringTest, test_for_search_multi) {
+	char** fruits = new char*[3]{ "APPLE", "PINEAPPLE", "APPLE PIE" };
+	char** drinks = new char*[2]{ "APPLE JUICE", "GRAPE SODA" };
+	auto lib1 = indexN(fruits, 3, 1, NULL);
+	auto lib2 = indexN(drinks, 2, 1, NULL);
+	char** result = nullptr;
+	float* scores = nullptr;
+	auto single = score(lib2, "apple", &result, &scores, 0.3f, 10);
+	ASSERT_EQ(1, single);
+	auto juiceScore = scores[0];
+	release(lib2, result, scores);
+
+	//the results of both libraries in a single list, the missing handle being skipped
+	uint32_t handles[3] = { lib1, 12345678, lib2 };
+	float weights[3] = { 1.0f, 1.0f, 0.5f };
+	uint32_t* sources = nullptr;
+	auto size = searchMulti(handles, weights, 3, " apple", &result, &scores, &sources, 0.3f, 10, SearchExact);
+	ASSERT_EQ(4, size);
+	EXPECT_STREQ("APPLE", result[0]);
+	EXPECT_FLOAT_EQ(100, scores[0]);
+	EXPECT_EQ(0, sources[0]);
+	for (uint32_t i = 1; i < size; i++)
+		EXPECT_GE(scores[i - 1], scores[i]);
+	auto juice = std::find_if(result, result + size, [](const char* str) { return strcmp(str, "APPLE JUICE") == 0; }) - result;
+	ASSERT_LT(juice, size);
+	EXPECT_EQ(2, sources[juice]);
+	EXPECT_FLOAT_EQ(juiceScore * 0.5f, scores[juice]);
+	releaseMulti(result, scores, sources);
+
+	//the limit applies to the merged list
+	size = searchMulti(handles, nullptr, 3, "APPLE", &result, nullptr, nullptr, 0.3f, 2, SearchExact);
+	EXPECT_EQ(2, size);
+	EXPECT_STREQ("APPLE", result[0]);
+	releaseMulti(result, nullptr, nullptr);
+
+	//a library indexed under a missing handle after the search keeps its own results pinned through releaseMulti
+	auto lib3 = indexN(drinks, 2, 1, NULL);
+	dispose(lib3);
+	uint32_t stale[2] = { lib1, lib3 };
+	size = searchMulti(stale, nullptr, 2, "APPLE", &result, nullptr, nullptr, 0.3f, 0, SearchExact);
+	EXPECT_EQ(3, size);
+	EXPECT_EQ(lib3, indexN(drinks, 2, 1, NULL));
+	char** pinned = nullptr;
+	EXPECT_EQ(1, search(lib3, "APPLE", &pinned, 0.3f, 0));
+	releaseMulti(result, nullptr, nullptr);
+	setMemoryBudget(1, std::filesystem::temp_directory_path().string().c_str());
+	EXPECT_FALSE(isResident(lib1));
+	EXPECT_TRUE(isResident(lib3));
+	release(lib3, pinned, nullptr);
+	setMemoryBudget(1, std::filesystem::temp_directory_path().string().c_str());
+	EXPECT_FALSE(isResident(lib3));
+	setMemoryBudget(0, nullptr);
+	dispose(lib1);
+	dispose(lib2);
+	dispose(lib3);
+	delete[] fruits;
+	delete[] drinks;
+}
+
+TEST(StringTest, test_for_query_plan) {
+	const char* parts[4] = { "HEX NUT M", "STEEL BOLT ", "FLAT WASHER ", "THREADED ROD " };
+	std::vector<std::string> corpus = { "AB", "NUT", "BOLT" };
+	for (int i = 0; i < 2000; i++)
+		corpus.push_back(parts[i % 4] + std::to_string(i));
+	std::vector<char*> words;
+	for (auto& word : corpus)
+		words.push_back(const_cast<char*>(word.c_str()));
+	auto lib = indexN(words.data(), words.size(), 1, NULL);
+
+	//a query too short for n-grams scans both parts
+	SearchPlan plan = SearchPlan();
+	explain(lib, "ab", 0.5f, SearchExact, &plan);
+	EXPECT_EQ(2, plan.queryLength);
+	EXPECT_EQ(PlanScan, plan.shortStrategy);
+	EXPECT_EQ(PlanScan, plan.longStrategy);
+	EXPECT_GT(plan.longScanCost, 0);
+
+	//a long query is cheaper to score by n-grams, and no short string can reach the threshold
+	explain(lib, "STEEL BOLT 1234", 0.7f, SearchExact, &plan);
+	EXPECT_EQ(PlanSkip, plan.shortStrategy);
+	EXPECT_EQ(PlanGrams, plan.longStrategy);
+	EXPECT_GE(plan.scanMinLength, 10);
+	EXPECT_LT(plan.gramCost, plan.longScanCost);
+	EXPECT_GT(plan.postings, 0);
+
+	//a short query of 8 characters at a low threshold scans the short strings
+	explain(lib, "NUT BOLT", 0.3f, SearchExact, &plan);
+	EXPECT_EQ(PlanScan, plan.shortStrategy);
+	explain(lib, "NUT BOLT", 0.8f, SearchExact, &plan);
+	EXPECT_EQ(PlanSkip, plan.shortStrategy);
+	explain(lib, "NUT BOLT", 0.8f, SearchExact | SearchFixedPlan, &plan);
+	EXPECT_EQ(PlanScan, plan.shortStrategy);
+	EXPECT_EQ(PlanGrams, plan.longStrategy);
+
+	//the planned search finds the same best match as the fixed one
+	char** result = nullptr;
+	auto size = searchEx(lib, "STEEL BOLT 1234", &result, nullptr, 0.7f, 5, SearchExact);
+	ASSERT_GT(size, 0);
+	std::string planned(result[0]);
+	release(lib, result, nullptr);
+	size = searchEx(lib, "STEEL BOLT 1234", &result, nullptr, 0.7f, 5, SearchExact | SearchFixedPlan);
+	ASSERT_GT(size, 0);
+	EXPECT_EQ(planned, result[0]);
+	release(lib, result, nullptr);
+
+	//the LSH buckets are only probed for an approximate search
+	buildLsh(lib, 16, 2);
+	explain(lib, "STEEL BOLT 1234", 0.7f, SearchExact, &plan);
+	EXPECT_EQ(0, plan.lshCandidates);
+	EXPECT_EQ(0, plan.lshCost);
+	explain(lib, "STEEL BOLT 1234", 0.7f, SearchApproximate, &plan);
+	EXPECT_GT(plan.lshCandidates, 0);
+	EXPECT_GT(plan.lshCost, 0);
+
+	//wildcards and missing libraries
+	explain(lib, "*", 0.5f, SearchExact, &plan);
+	EXPECT_TRUE(plan.wildcard);
+	plan.queryLength = 77;
+	explain(12345678, "ab", 0.5f, SearchExact, &plan);
+	EXPECT_EQ(77, plan.queryLength);
+	dispose(lib);
+}
+
+TEST(StringTest, test_for_string_pool) {
+	//blocks of front-coded strings, with a prefix longer than a byte of its varint, encoded out of order
+	std::vector<std::string> strings = { "" };
+	for (int i = 0; i < 40; i++)
+		strings.push_back(std::string(200, 'A') + std::to_string(i));
+	std::mt19937 rng(7);
+	std::shuffle(strings.begin(), strings.end(), rng);
+	FrontCodedPool pool;
+	pool.encode(strings);
+	ASSERT_EQ(strings.size(), pool.size());
+	EXPECT_LT(pool.bytes(), 40 * 200);
+	std::string decoded;
+	for (size_t i = strings.size(); i-- > 0;)
+	{
+		pool.decode(i, decoded);
+		EXPECT_EQ(strings[i], decoded);
+		EXPECT_EQ(strings[i].size(), pool.length(i));
+	}
+
+	std::vector<std::string> corpus;
+	for (int i = 0; i < 300; i++)
+	{
+		corpus.push_back("ACME WIDGET MODEL " + std::to_string(i));
+		corpus.push_back(i % 3 ? "ACME" : "WIDGET " + std::to_string(i % 7));
+	}
+	std::vector<char*> words;
+	for (auto& word : corpus)
+		words.push_back(const_cast<char*>(word.c_str()));
+	auto lib = indexN(words.data(), words.size(), 2, NULL);
+	const char* queries[5] = { "widget model 123", "12", "ACME", "WIDGET 5", "*" };
+	auto searchAll = [&](uint32_t handle) {
+		std::vector<std::pair<std::string, float>> found;
+		for (auto query : queries)
+		{
+			char** result = nullptr;
+			float* scores = nullptr;
+			auto size = score(handle, query, &result, &scores, 0.5f, 0);
+			for (uint32_t i = 0; i < size; i++)
+				found.emplace_back(result[i], scores[i]);
+			release(handle, result, scores);
+		}
+		//results of equal scores and lengths come in any order
+		std::sort(found.begin(), found.end());
+		return found;
+	};
+	auto expected = searchAll(lib);
+	IndexStats whole;
+	getIndexStats(lib, &whole);
+	EXPECT_FALSE(whole.compressedStrings);
+	EXPECT_EQ(0, whole.stringPoolSavedBytes);
+
+	//not compressed while results point into the strings
+	char** held = nullptr;
+	search(lib, "ACME", &held, 0.5f, 1);
+	EXPECT_FALSE(setStringPool(lib, true));
+	release(lib, held, nullptr);
+	ASSERT_TRUE(setStringPool(lib, true));
+
+	IndexStats pooled;
+	getIndexStats(lib, &pooled);
+	EXPECT_TRUE(pooled.compressedStrings);
+	EXPECT_EQ(whole.strings, pooled.strings);
+	EXPECT_GT(pooled.stringPoolSavedBytes, 0);
+	EXPECT_LT(pooled.stringLibBytes, whole.stringLibBytes);
+	EXPECT_EQ(getMemoryUsage(lib), pooled.totalBytes);
+	EXPECT_EQ(expected, searchAll(lib));
+
+	//the decoded results of a compressed library merge with the others
+	auto plain = indexN(words.data(), words.size(), 2, NULL);
+	uint32_t handles[2] = { lib, plain };
+	char** result = nullptr;
+	auto size = searchMulti(handles, nullptr, 2, "ACME WIDGET MODEL 7", &result, nullptr, nullptr, 0.5f, 4, SearchExact);
+	ASSERT_EQ(4, size);
+	EXPECT_STREQ("ACME WIDGET MODEL 7", result[0]);
+	EXPECT_STREQ("ACME WIDGET MODEL 7", result[1]);
+	releaseMulti(result, nullptr, nullptr);
+
+	//a typeahead session decodes the short strings it scans
+	auto session = openSession(lib);
+	size = extendQuery(session, "ACM", &result, nullptr, 0.5f, 0);
+	std::set<std::string> incremental(result, result + size);
+	release(lib, result, nullptr);
+	size = search(plain, "ACM", &result, 0.5f, 0);
+	EXPECT_EQ(std::set<std::string>(result, result + size), incremental);
+	release(plain, result, nullptr);
+	closeSession(session);
+
+	//compressed again when reloaded from a snapshot, the plain library being the one used last
+	setMemoryBudget(getMemoryUsage(plain) + getMemoryUsage(lib) / 2, std::filesystem::temp_directory_path().string().c_str());
+	EXPECT_FALSE(isResident(lib));
+	EXPECT_EQ(expected, searchAll(lib));
+	getIndexStats(lib, &pooled);
+	EXPECT_TRUE(pooled.compressedStrings);
+	setMemoryBudget(0, nullptr);
+
+	ASSERT_TRUE(setStringPool(lib, false));
+	getIndexStats(lib, &pooled);
+	EXPECT_FALSE(pooled.compressedStrings);
+	EXPECT_EQ(whole.stringLibBytes, pooled.stringLibBytes);
+	EXPECT_EQ(expected, searchAll(lib));
+	dispose(lib);
+	dispose(plain);
+}
+
+TEST(StringTest, test_for_async_search) {
+	char** words = new char*[4]{
+		"APPLE", "PINEAPPLE", "APPLE PIE", "MAPLE SYRUP"
+	};
+	auto lib = indexN(words, 4, 1, NULL);
+	char** result = nullptr;
+	auto size = search(lib, "APPLE", &result, 0.5f, 0);
+	release(lib, result, nullptr);
+
+	std::pair<uint32_t, std::promise<uint32_t>> pending;
+	pending.first = lib;
+	auto request = searchAsync(lib, "APPLE", 0.5f, 0, [](void* userData, uint64_t, char** results, float* scores, uint32_t size) {
+		auto target = static_cast<std::pair<uint32_t, std::promise<uint32_t>>*>(userData);
+		release(target->first, results, scores);
+		target->second.set_value(size);
+	}, &pending);
+	EXPECT_NE(0, request);
+	EXPECT_EQ(size, pending.second.get_future().get());
+
+	//the queue holds 2 searches until they are polled
+	auto queue = createCompletionQueue(2);
+	EXPECT_NE(0, searchQueued(queue, lib, "APPLE", 0.5f, 0, nullptr));
+	EXPECT_NE(0, searchQueued(queue, lib, "MAPLE", 0.5f, 0, nullptr));
+	EXPECT_EQ(0, searchQueued(queue, lib, "SYRUP", 0.5f, 0, nullptr));
+	Completion completions[2];
+	uint32_t polled = 0;
+	while (polled < 2)
+		polled += pollCompletions(queue, completions + polled, 2 - polled);
+	for (auto& completion : completions)
+	{
+		EXPECT_EQ(lib, completion.handle);
+		EXPECT_GT(completion.size, 0);
+		release(completion.handle, completion.results, completion.scores);
+	}
+	EXPECT_NE(0, searchQueued(queue, lib, "SYRUP", 0.5f, 0, nullptr));
+
+	//the executor runs the searches submitted before it stops, and a later search starts it again
+	shutdownAsync();
+	EXPECT_EQ(1, pollCompletions(queue, completions, 2));
+	release(completions[0].handle, completions[0].results, completions[0].scores);
+	shutdownAsync();
+	EXPECT_NE(0, searchQueued(queue, lib, "APPLE", 0.5f, 0, nullptr));
+	shutdownAsync();
+	EXPECT_EQ(1, pollCompletions(queue, completions, 2));
+	release(completions[0].handle, completions[0].results, completions[0].scores);
+	destroyCompletionQueue(queue);
+	dispose(lib);
+	delete[] words;
+}
@@ -0,0 +1,169 @@
+#ifndef BITSLICEDCOUNTER_H
+#define BITSLICEDCOUNTER_H
+
+#include <cstdint>
+#include <cstddef>
+#include "PackedStrings.h"
+
+namespace StringSearch
+{
+	/*!
+	BitSlicedCounter: Counts, for each position of a range of words, how many of a set of bitmaps have its bit set.
+	The counts are kept as bit slices, i.e. bit k of the count of each position is held by the k-th slice, so adding a bitmap
+	is a ripple carry over whole words, and no position is visited one by one.
+	*/
+	class BitSlicedCounter
+	{
+	public:
+		//! Bits of a count
+		static constexpr size_t slices = 8;
+		//! The most bitmaps counted at once
+		static constexpr size_t maxBitmaps = (1 << slices) - 1;
+
+		//! A kernel of \p count
+		typedef void(*Kernel)(const uint32_t* const* bitmaps, size_t count, size_t first, size_t words, uint32_t* sliced);
+
+		/*!
+		Get the number of slices needed to count a number of bitmaps
+		@param count The number of bitmaps, at most \p maxBitmaps
+		*/
+		static size_t width(size_t count)
+		{
+			size_t bits = 0;
+			while (((size_t)1 << bits) <= count)
+				bits++;
+			return bits;
+		}
+
+		/*!
+		Counts the bitmaps set for each position of a range of words.
+		Runs the widest kernel the processor supports.
+		@param bitmaps The bitmaps, at least \p first + \p words words long each
+		@param count The number of bitmaps, at most \p maxBitmaps
+		@param first The first word of the range
+		@param words The number of words of the range
+		@param sliced Output \p width(count) slices of \p words words each, one after another.
+		Bit b of word w of slice k is bit k of the count of bit b of word \p first + w.
+		@param kernel The kernel to run instead, e.g. to compare them.
+		*/
+		static void count(const uint32_t* const* bitmaps, size_t count, size_t first, size_t words, uint32_t* sliced, Kernel kernel = nullptr)
+		{
+			static const auto widest = selectKernel();
+			(kernel ? kernel : widest)(bitmaps, count, first, words, sliced);
+		}
+
+		/*!
+		The kernel processing one word at a time
+		@param bitmaps The bitmaps
+		@param count The number of bitmaps
+		@param first The first word of the range
+		@param words The number of words of the range
+		@param sliced Output the slices of the counts
+		*/
+		static void countScalar(const uint32_t* const* bitmaps, size_t count, size_t first, size_t words, uint32_t* sliced)
+		{
+			countWords(bitmaps, count, first, words, 0, sliced);
+		}
+
+#if defined(PACKED_X86)
+		/*!
+		The kernel processing 4 words at a time with SSE2
+		*/
+		PACKED_TARGET("sse2")
+		static void countSse2(const uint32_t* const* bitmaps, size_t count, size_t first, size_t words, uint32_t* sliced)
+		{
+			auto bits = width(count);
+			size_t w = 0;
+			for (; w + 4 <= words; w += 4)
+			{
+				__m128i slice[slices];
+				for (size_t k = 0; k < bits; k++)
+					slice[k] = _mm_setzero_si128();
+				for (size_t i = 0; i < count; i++)
+				{
+					auto carry = _mm_loadu_si128(reinterpret_cast<const __m128i*>(bitmaps[i] + first + w));
+					for (size_t k = 0; k < bits; k++)
+					{
+						auto next = _mm_and_si128(slice[k], carry);
+						slice[k] = _mm_xor_si128(slice[k], carry);
+						carry = next;
+					}
+				}
+				for (size_t k = 0; k < bits; k++)
+					_mm_storeu_si128(reinterpret_cast<__m128i*>(sliced + k * words + w), slice[k]);
+			}
+			countWords(bitmaps, count, first, words, w, sliced);
+		}
+
+		/*!
+		The kernel processing 8 words at a time with AVX2
+		*/
+		PACKED_TARGET("avx2")
+		static void countAvx2(const uint32_t* const* bitmaps, size_t count, size_t first, size_t words, uint32_t* sliced)
+		{
+			auto bits = width(count);
+			size_t w = 0;
+			for (; w + 8 <= words; w += 8)
+			{
+				__m256i slice[slices];
+				for (size_t k = 0; k < bits; k++)
+					slice[k] = _mm256_setzero_si256();
+				for (size_t i = 0; i < count; i++)
+				{
+					auto carry = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(bitmaps[i] + first + w));
+					for (size_t k = 0; k < bits; k++)
+					{
+						auto next = _mm256_and_si256(slice[k], carry);
+						slice[k] = _mm256_xor_si256(slice[k], carry);
+						carry = next;
+					}
+				}
+				for (size_t k = 0; k < bits; k++)
+					_mm256_storeu_si256(reinterpret_cast<__m256i*>(sliced + k * words + w), slice[k]);
+			}
+			countWords(bitmaps, count, first, words, w, sliced);
+		}
+#endif
+
+		/*!
+		Selects the widest kernel the processor supports
+		*/
+		static Kernel selectKernel()
+		{
+#if defined(PACKED_X86)
+			if (PackedStrings::hasAvx2())
+				return &BitSlicedCounter::countAvx2;
+			if (PackedStrings::hasSse2())
+				return &BitSlicedCounter::countSse2;
+#endif
+			return &BitSlicedCounter::countScalar;
+		}
+
+	private:
+		/*!
+		Counts the words of the range from \p from on, one at a time. Finishes the range left by the SIMD kernels.
+		*/
+		static void countWords(const uint32_t* const* bitmaps, size_t count, size_t first, size_t words, size_t from, uint32_t* sliced)
+		{
+			auto bits = width(count);
+			for (size_t w = from; w < words; w++)
+			{
+				uint32_t slice[slices] = {};
+				for (size_t i = 0; i < count; i++)
+				{
+					auto carry = bitmaps[i][first + w];
+					for (size_t k = 0; k < bits; k++)
+					{
+						auto next = slice[k] & carry;
+						slice[k] ^= carry;
+						carry = next;
+					}
+				}
+				for (size_t k = 0; k < bits; k++)
+					sliced[k * words + w] = slice[k];
+			}
+		}
+	};
+};
+
+#endif
@@ -0,0 +1,158 @@
+#ifndef FRONTCODEDPOOL_H
+#define FRONTCODEDPOOL_H
+
+#include <cstdint>
+#include <cstddef>
+#include <string>
+#include <vector>
+#include <algorithm>
+#include <numeric>
+
+namespace StringSearch
+{
+	/*!
+	FrontCodedPool: Strings stored in sorted order, in blocks of \p blockStrings, each string but the first of a block keeping only
+	what follows the prefix it shares with the string before it. The first string of each block is stored whole, and its offset is
+	kept in a directory of restart points, so a string is decoded by walking at most one block. The ids of the strings are kept as
+	they were encoded, each mapped to the rank of its string in the sorted order.
+	*/
+	class FrontCodedPool
+	{
+	public:
+		//! Strings per block, i.e. between two restart points
+		static constexpr size_t blockStrings = 16;
+
+		/*!
+		Encodes strings, replacing the previous ones
+		@param strings The strings, in any order. The id of each string is its position.
+		*/
+		void encode(const std::vector<std::string>& strings)
+		{
+			//sorted, so that neighbouring strings share the longest prefixes
+			std::vector<uint32_t> order(strings.size());
+			std::iota(order.begin(), order.end(), 0);
+			std::sort(order.begin(), order.end(), [&](uint32_t a, uint32_t b) { return strings[a] < strings[b]; });
+			data.clear();
+			restarts.clear();
+			lengths.clear();
+			ranks.assign(strings.size(), 0);
+			lengths.reserve(strings.size());
+			restarts.reserve((strings.size() + blockStrings - 1) / blockStrings);
+			for (size_t i = 0; i < order.size(); i++)
+			{
+				auto& str = strings[order[i]];
+				ranks[order[i]] = (uint32_t)i;
+				size_t shared = 0;
+				if (i % blockStrings == 0)
+					restarts.push_back(data.size());
+				else
+				{
+					auto& previous = strings[order[i - 1]];
+					auto most = std::min(previous.size(), str.size());
+					while (shared < most && previous[shared] == str[shared])
+						shared++;
+				}
+				//the length of the suffix follows from the length of the string, which is kept apart
+				writeVarint(shared);
+				data.insert(data.end(), str.begin() + shared, str.end());
+				lengths.push_back((uint32_t)str.size());
+			}
+			data.shrink_to_fit();
+			restarts.shrink_to_fit();
+		}
+
+		/*!
+		Frees the strings
+		*/
+		void clear()
+		{
+			std::vector<uint8_t>().swap(data);
+			std::vector<uint64_t>().swap(restarts);
+			std::vector<uint32_t>().swap(lengths);
+			std::vector<uint32_t>().swap(ranks);
+		}
+
+		/*!
+		Get the number of strings
+		*/
+		size_t size() const
+		{
+			return lengths.size();
+		}
+
+		/*!
+		Get the length of a string, without decoding it
+		@param id The position of the string
+		*/
+		size_t length(size_t id) const
+		{
+			return lengths[ranks[id]];
+		}
+
+		/*!
+		Decodes a string
+		@param id The position of the string
+		@param str Output the string. Its buffer is reused, so decoding into the same string again does not allocate.
+		*/
+		void decode(size_t id, std::string& str) const
+		{
+			auto rank = ranks[id];
+			auto block = rank / blockStrings;
+			auto p = data.data() + restarts[block];
+			for (size_t i = block * blockStrings; i <= rank; i++)
+			{
+				auto shared = readVarint(p);
+				auto suffix = lengths[i] - shared;
+				str.resize(shared);
+				str.append(reinterpret_cast<const char*>(p), suffix);
+				p += suffix;
+			}
+		}
+
+		/*!
+		Get the heap bytes of the encoded strings, the restart points, the lengths and the ranks
+		*/
+		size_t bytes() const
+		{
+			return data.capacity() + restarts.capacity() * sizeof(uint64_t) + (lengths.capacity() + ranks.capacity()) * sizeof(uint32_t);
+		}
+
+	private:
+		/*!
+		Appends a value in 7 bits per byte, the high bit flagging the bytes that follow
+		*/
+		void writeVarint(size_t value)
+		{
+			while (value >= 0x80)
+			{
+				data.push_back((uint8_t)(value | 0x80));
+				value >>= 7;
+			}
+			data.push_back((uint8_t)value);
+		}
+
+		/*!
+		Reads a value written by \p writeVarint, and moves past it
+		*/
+		static size_t readVarint(const uint8_t*& p)
+		{
+			size_t value = 0;
+			for (size_t shift = 0;; shift += 7)
+			{
+				auto byte = *p++;
+				value |= (size_t)(byte & 0x7f) << shift;
+				if (byte < 0x80)
+					return value;
+			}
+		}
+
+		std::vector<uint8_t> data;
+		std::vector<uint64_t> restarts;
+		//! The length of each string, by rank
+		std::vector<uint32_t> lengths;
+		//! The rank of each string in the sorted order, by id
+		std::vector<uint32_t> ranks;
+	};
+};
+
+#endif
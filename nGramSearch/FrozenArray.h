@@ -0,0 +1,358 @@
+#ifndef FROZENARRAY_H
+#define FROZENARRAY_H
+
+#include <cstdint>
+#include <cstring>
+#include <cstdio>
+#include <vector>
+#include <string>
+#include <new>
+#if defined(_WIN32)
+#ifndef NOMINMAX
+#define NOMINMAX
+#endif
+#ifndef WIN32_LEAN_AND_MEAN
+#define WIN32_LEAN_AND_MEAN
+#endif
+#include <windows.h>
+#elif defined(__linux__)
+#include <sys/mman.h>
+#include <sched.h>
+#include <pthread.h>
+#endif
+
+namespace StringSearch
+{
+	/*!
+	How the frozen arrays of a library are backed by huge pages
+	*/
+	enum HugePages : uint8_t
+	{
+		//! Regular pages
+		HugePagesOff = 0,
+		//! Transparent huge pages on Linux, advised with madvise. Large pages on Windows, which need the "Lock pages in memory" privilege.
+		HugePagesTransparent = 1,
+		//! Huge pages reserved by the administrator (MAP_HUGETLB) on Linux, falling back to transparent ones when none is free. As \p HugePagesTransparent elsewhere.
+		HugePagesExplicit = 2
+	};
+
+	/*!
+	NumaTopology: The NUMA nodes of the machine, and the processors of each. A machine without NUMA support has a single node.
+	*/
+	class NumaTopology
+	{
+	public:
+		/*!
+		Get the topology of the machine, read once
+		*/
+		static const NumaTopology& get()
+		{
+			static NumaTopology topology;
+			return topology;
+		}
+
+		/*!
+		Get the number of NUMA nodes, at least 1
+		*/
+		size_t nodes() const
+		{
+			return nodeCount;
+		}
+
+		/*!
+		Get the node of the processor running the calling thread, from 0 to \p nodes - 1
+		*/
+		size_t currentNode() const
+		{
+			if (nodeCount < 2)
+				return 0;
+#if defined(_WIN32)
+			PROCESSOR_NUMBER processor;
+			GetCurrentProcessorNumberEx(&processor);
+			USHORT node = 0;
+			if (!GetNumaProcessorNodeEx(&processor, &node))
+				return 0;
+			return node < nodeCount ? node : 0;
+#elif defined(__linux__)
+			int cpu = sched_getcpu();
+			return cpu >= 0 && (size_t)cpu < cpuNode.size() ? cpuNode[cpu] : 0;
+#else
+			return 0;
+#endif
+		}
+
+		/*!
+		Restricts the calling thread to the processors of a node, so that the memory it touches first is allocated on that node
+		@param node The node, from 0 to \p nodes - 1
+		@returns Whether the thread has been pinned
+		*/
+		bool pin(size_t node) const
+		{
+			if (nodeCount < 2 || node >= nodeCount)
+				return false;
+#if defined(_WIN32)
+			GROUP_AFFINITY affinity;
+			if (!GetNumaNodeProcessorMaskEx((USHORT)node, &affinity))
+				return false;
+			return SetThreadGroupAffinity(GetCurrentThread(), &affinity, nullptr) != 0;
+#elif defined(__linux__)
+			cpu_set_t cpus;
+			CPU_ZERO(&cpus);
+			for (size_t cpu = 0; cpu < cpuNode.size() && cpu < CPU_SETSIZE; cpu++)
+				if (cpuNode[cpu] == node)
+					CPU_SET(cpu, &cpus);
+			return pthread_setaffinity_np(pthread_self(), sizeof(cpus), &cpus) == 0;
+#else
+			return false;
+#endif
+		}
+
+		/*!
+		Lets the calling thread run on the processors of all nodes again, after \p pin
+		@returns Whether the thread has been released
+		*/
+		bool unpin() const
+		{
+			if (nodeCount < 2)
+				return false;
+#if defined(_WIN32)
+			DWORD_PTR process = 0, system = 0;
+			if (!GetProcessAffinityMask(GetCurrentProcess(), &process, &system))
+				return false;
+			return SetThreadAffinityMask(GetCurrentThread(), process) != 0;
+#elif defined(__linux__)
+			cpu_set_t cpus;
+			CPU_ZERO(&cpus);
+			for (size_t cpu = 0; cpu < cpuNode.size() && cpu < CPU_SETSIZE; cpu++)
+				CPU_SET(cpu, &cpus);
+			return pthread_setaffinity_np(pthread_self(), sizeof(cpus), &cpus) == 0;
+#else
+			return false;
+#endif
+		}
+
+	private:
+		/*!
+		Reads the topology from the operating system
+		*/
+		NumaTopology()
+		{
+#if defined(_WIN32)
+			ULONG highest = 0;
+			if (GetNumaHighestNodeNumber(&highest))
+				nodeCount = (size_t)highest + 1;
+#elif defined(__linux__)
+			//the online nodes, then the processors of each, numbered densely in case of gaps
+			std::vector<size_t> online;
+			readList("/sys/devices/system/node/online", online);
+			for (auto id : online)
+			{
+				std::vector<size_t> cpus;
+				readList(("/sys/devices/system/node/node" + std::to_string(id) + "/cpulist").c_str(), cpus);
+				if (cpus.empty())
+					continue;
+				for (auto cpu : cpus)
+				{
+					if (cpu >= cpuNode.size())
+						cpuNode.resize(cpu + 1, 0);
+					cpuNode[cpu] = nodeCount;
+				}
+				nodeCount++;
+			}
+#endif
+			if (nodeCount == 0)
+				nodeCount = 1;
+		}
+
+		/*!
+		Reads a list of ranges in the sysfs format, e.g. 0-3,8-11
+		@param path The file to be read
+		@param values Output the values listed
+		*/
+		static void readList(const char* path, std::vector<size_t>& values)
+		{
+			auto file = std::fopen(path, "r");
+			if (!file)
+				return;
+			unsigned long first = 0, last = 0;
+			for (;;)
+			{
+				if (std::fscanf(file, "%lu", &first) != 1)
+					break;
+				last = first;
+				int next = std::fgetc(file);
+				if (next == '-')
+				{
+					if (std::fscanf(file, "%lu", &last) != 1)
+						break;
+					next = std::fgetc(file);
+				}
+				for (auto value = first; value <= last; value++)
+					values.push_back(value);
+				if (next != ',')
+					break;
+			}
+			std::fclose(file);
+		}
+
+		size_t nodeCount = 0;
+		//! The node of each processor
+		std::vector<size_t> cpuNode;
+	};
+
+	/*!
+	FrozenArray: A read-only copy of an array in memory mapped for it, optionally backed by huge pages.
+	The memory is first touched by the constructing thread, so on NUMA machines it is local to the node of that thread.
+	*/
+	template<typename T>
+	class FrozenArray
+	{
+	public:
+		/*!
+		Copies an array
+		@param source The values to be copied
+		@param count The number of values
+		@param mode How the copy is backed by huge pages
+		*/
+		FrozenArray(const T* source, size_t count, HugePages mode) : count(count)
+		{
+			if (count == 0)
+				return;
+			auto bytes = count * sizeof(T);
+#if defined(_WIN32)
+			ULONG node = (ULONG)NumaTopology::get().currentNode();
+			auto largePage = GetLargePageMinimum();
+			if (mode != HugePagesOff && largePage)
+			{
+				mapped = (bytes + largePage - 1) / largePage * largePage;
+				values = static_cast<T*>(VirtualAllocExNuma(GetCurrentProcess(), nullptr, mapped,
+					MEM_RESERVE | MEM_COMMIT | MEM_LARGE_PAGES, PAGE_READWRITE, node));
+				huge = values != nullptr;
+			}
+			if (!values)
+			{
+				mapped = bytes;
+				values = static_cast<T*>(VirtualAllocExNuma(GetCurrentProcess(), nullptr, mapped, MEM_RESERVE | MEM_COMMIT, PAGE_READWRITE, node));
+			}
+#elif defined(__linux__)
+			const size_t hugePage = 2 << 20;
+			if (mode == HugePagesExplicit)
+			{
+				mapped = (bytes + hugePage - 1) / hugePage * hugePage;
+				void* region = mmap(nullptr, mapped, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+				if (region != MAP_FAILED)
+				{
+					values = static_cast<T*>(region);
+					huge = true;
+				}
+			}
+			if (!values && mode != HugePagesOff)
+			{
+				//transparent huge pages are only formed in aligned 2MB extents, so the mapping is aligned by trimming its ends
+				mapped = (bytes + hugePage - 1) / hugePage * hugePage;
+				auto region = static_cast<char*>(mmap(nullptr, mapped + hugePage, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0));
+				if (region != MAP_FAILED)
+				{
+					auto aligned = region + (hugePage - (uintptr_t)region % hugePage) % hugePage;
+					if (aligned != region)
+						munmap(region, aligned - region);
+					munmap(aligned + mapped, region + hugePage - aligned);
+					values = reinterpret_cast<T*>(aligned);
+					huge = madvise(aligned, mapped, MADV_HUGEPAGE) == 0;
+				}
+			}
+			if (!values)
+			{
+				//mapped rather than taken from the heap, whose pages may have been touched by another node
+				mapped = bytes;
+				void* region = mmap(nullptr, mapped, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+				if (region != MAP_FAILED)
+					values = static_cast<T*>(region);
+			}
+#else
+			mapped = bytes;
+			values = static_cast<T*>(::operator new(mapped, std::nothrow));
+#endif
+			if (values)
+				std::memcpy(values, source, bytes);
+			else
+			{
+				this->count = 0;
+				mapped = 0;
+			}
+		}
+
+		/*!
+		Adopts the values of a vector, e.g. when no memory could be mapped for a copy of them. They stay on the heap, in regular pages.
+		@param source The values, moved into the array
+		*/
+		explicit FrozenArray(std::vector<T>&& source) : heap(std::move(source))
+		{
+			count = heap.size();
+			mapped = heap.capacity() * sizeof(T);
+			if (count)
+				values = heap.data();
+		}
+
+		FrozenArray(const FrozenArray&) = delete;
+		FrozenArray& operator=(const FrozenArray&) = delete;
+
+		/*!
+		Releases the memory of the array
+		*/
+		~FrozenArray()
+		{
+			if (!values || !heap.empty())
+				return;
+#if defined(_WIN32)
+			VirtualFree(values, 0, MEM_RELEASE);
+#elif defined(__linux__)
+			munmap(values, mapped);
+#else
+			::operator delete(values);
+#endif
+		}
+
+		/*!
+		Get the values. nullptr if the array is empty, or if it could not be allocated.
+		*/
+		const T* data() const
+		{
+			return values;
+		}
+
+		/*!
+		Get the number of values
+		*/
+		size_t size() const
+		{
+			return count;
+		}
+
+		/*!
+		Get the bytes mapped for the array, including the rounding to whole huge pages
+		*/
+		size_t bytes() const
+		{
+			return mapped;
+		}
+
+		/*!
+		Whether the array is backed by huge pages. Transparent huge pages are only advised, so the kernel may still use regular pages.
+		*/
+		bool hugePages() const
+		{
+			return huge;
+		}
+
+	private:
+		T* values = nullptr;
+		size_t count = 0;
+		size_t mapped = 0;
+		bool huge = false;
+		//! The values when adopted from a vector rather than copied
+		std::vector<T> heap;
+	};
+};
+
+#endif
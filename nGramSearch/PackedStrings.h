@@ -0,0 +1,287 @@
+#ifndef PACKEDSTRINGS_H
+#define PACKEDSTRINGS_H
+
+#include <cstdint>
+#include <cstring>
+#include <string>
+#include <vector>
+#include <algorithm>
+#if defined(__x86_64__) || defined(_M_X64) || defined(__i386__) || defined(_M_IX86)
+#define PACKED_X86
+#include <immintrin.h>
+#if defined(_MSC_VER)
+#include <intrin.h>
+#endif
+#endif
+
+//compiles a function for an instruction set beyond the baseline, to be called only if the processor supports it
+#if defined(__GNUC__) || defined(__clang__)
+#define PACKED_TARGET(isa) __attribute__((target(isa)))
+#else
+#define PACKED_TARGET(isa)
+#endif
+
+namespace StringSearch
+{
+	/*!
+	PackedStrings: Strings of at most \p width characters, packed in blocks of \p lanes strings so that a SIMD register
+	holds one character of every string of a block. Each block stores \p width rows of characters, padded with 0,
+	followed by a row of lengths.
+	*/
+	class PackedStrings
+	{
+	public:
+		//! The longest string packed
+		static constexpr size_t width = 5;
+		//! Strings per block, the bytes of the widest register used
+		static constexpr size_t lanes = 32;
+		//! Bytes of a block
+		static constexpr size_t blockBytes = (width + 1) * lanes;
+		//! The longest query scored by the SIMD kernels, whose distances saturate at 255
+		static constexpr size_t maxQuery = 250;
+
+		/*!
+		Packs strings
+		@param strings The strings, each at most \p width characters long
+		*/
+		void pack(const std::vector<const std::string*>& strings)
+		{
+			count = strings.size();
+			blocks.assign((count + lanes - 1) / lanes * blockBytes, 0);
+			for (size_t i = 0; i < count; i++)
+			{
+				auto block = &blocks[i / lanes * blockBytes];
+				auto lane = i % lanes;
+				auto& str = *strings[i];
+				auto len = std::min(str.size(), width);
+				for (size_t c = 0; c < len; c++)
+					block[c * lanes + lane] = (uint8_t)str[c];
+				block[width * lanes + lane] = (uint8_t)len;
+			}
+			blocks.shrink_to_fit();
+		}
+
+		/*!
+		Get the number of strings packed
+		*/
+		size_t size() const
+		{
+			return count;
+		}
+
+		/*!
+		Get the heap bytes of the blocks
+		*/
+		size_t bytes() const
+		{
+			return blocks.capacity();
+		}
+
+		//! A kernel of \p match, computing the distances of the strings of \p blockCount blocks
+		typedef void(*Kernel)(const uint8_t* blocks, size_t blockCount, const std::string& query, uint8_t* misMatch);
+
+		/*!
+		Computes the edit distance of the query to the closest substring of each string, as in \p StringIndex::stringMatch.
+		Runs the widest kernel the processor supports.
+		@param query The query string, at most \p maxQuery characters long
+		@param misMatch Output the distance of each string. Its size must be at least \p size rounded up to a multiple of \p lanes.
+		@param kernel The kernel to run instead, e.g. to compare them.
+		*/
+		void match(const std::string& query, uint8_t* misMatch, Kernel kernel = nullptr) const
+		{
+			static const auto widest = selectKernel();
+			(kernel ? kernel : widest)(blocks.data(), blocks.size() / blockBytes, query, misMatch);
+		}
+
+		/*!
+		The kernel processing one string at a time, for processors without SIMD support
+		@param blocks The packed blocks
+		@param blockCount The number of blocks
+		@param query The query string
+		@param misMatch Output the distance of each string
+		*/
+		static void matchScalar(const uint8_t* blocks, size_t blockCount, const std::string& query, uint8_t* misMatch)
+		{
+			uint8_t row[width + 1];
+			for (size_t b = 0; b < blockCount; b++)
+			{
+				auto block = blocks + b * blockBytes;
+				for (size_t lane = 0; lane < lanes; lane++)
+				{
+					size_t len = block[width * lanes + lane];
+					std::fill(row, row + width + 1, (uint8_t)0);
+					for (size_t q = 0; q < query.size(); q++)
+					{
+						uint8_t diagonal = row[0];
+						row[0] = (uint8_t)std::min(q + 1, (size_t)255);
+						for (size_t s = 0; s < len; s++)
+						{
+							uint8_t cost = (uint8_t)query[q] != block[s * lanes + lane];
+							uint8_t above = row[s + 1];
+							row[s + 1] = std::min(std::min(saturate(above + 1), saturate(row[s] + 1)), saturate(diagonal + cost));
+							diagonal = above;
+						}
+					}
+					misMatch[b * lanes + lane] = *std::min_element(row, row + len + 1);
+				}
+			}
+		}
+
+#if defined(PACKED_X86)
+		/*!
+		The kernel processing 16 strings at a time with SSE2
+		*/
+		PACKED_TARGET("sse2")
+		static void matchSse2(const uint8_t* blocks, size_t blockCount, const std::string& query, uint8_t* misMatch)
+		{
+			const __m128i one = _mm_set1_epi8(1);
+			const __m128i full = _mm_set1_epi8(-1);
+			for (size_t b = 0; b < blockCount; b++)
+				for (size_t half = 0; half < lanes; half += 16)
+				{
+					auto block = blocks + b * blockBytes + half;
+					__m128i chars[width];
+					__m128i row[width + 1];
+					for (size_t c = 0; c < width; c++)
+						chars[c] = _mm_loadu_si128(reinterpret_cast<const __m128i*>(block + c * lanes));
+					for (size_t s = 0; s <= width; s++)
+						row[s] = _mm_setzero_si128();
+					for (size_t q = 0; q < query.size(); q++)
+					{
+						auto ch = _mm_set1_epi8(query[q]);
+						auto diagonal = row[0];
+						row[0] = _mm_set1_epi8((char)std::min(q + 1, (size_t)255));
+						for (size_t s = 0; s < width; s++)
+						{
+							auto cost = _mm_andnot_si128(_mm_cmpeq_epi8(chars[s], ch), one);
+							auto above = row[s + 1];
+							row[s + 1] = _mm_min_epu8(_mm_min_epu8(_mm_adds_epu8(above, one), _mm_adds_epu8(row[s], one)),
+								_mm_adds_epu8(diagonal, cost));
+							diagonal = above;
+						}
+					}
+					//the cells beyond the length of a string are masked out of the minimum
+					auto lengths = _mm_loadu_si128(reinterpret_cast<const __m128i*>(block + width * lanes));
+					auto best = row[0];
+					for (size_t s = 1; s <= width; s++)
+					{
+						auto within = _mm_cmpeq_epi8(_mm_max_epu8(lengths, _mm_set1_epi8((char)s)), lengths);
+						best = _mm_min_epu8(best, _mm_or_si128(row[s], _mm_andnot_si128(within, full)));
+					}
+					_mm_storeu_si128(reinterpret_cast<__m128i*>(misMatch + b * lanes + half), best);
+				}
+		}
+
+		/*!
+		The kernel processing 32 strings at a time with AVX2
+		*/
+		PACKED_TARGET("avx2")
+		static void matchAvx2(const uint8_t* blocks, size_t blockCount, const std::string& query, uint8_t* misMatch)
+		{
+			const __m256i one = _mm256_set1_epi8(1);
+			const __m256i full = _mm256_set1_epi8(-1);
+			for (size_t b = 0; b < blockCount; b++)
+			{
+				auto block = blocks + b * blockBytes;
+				__m256i chars[width];
+				__m256i row[width + 1];
+				for (size_t c = 0; c < width; c++)
+					chars[c] = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(block + c * lanes));
+				for (size_t s = 0; s <= width; s++)
+					row[s] = _mm256_setzero_si256();
+				for (size_t q = 0; q < query.size(); q++)
+				{
+					auto ch = _mm256_set1_epi8(query[q]);
+					auto diagonal = row[0];
+					row[0] = _mm256_set1_epi8((char)std::min(q + 1, (size_t)255));
+					for (size_t s = 0; s < width; s++)
+					{
+						auto cost = _mm256_andnot_si256(_mm256_cmpeq_epi8(chars[s], ch), one);
+						auto above = row[s + 1];
+						row[s + 1] = _mm256_min_epu8(_mm256_min_epu8(_mm256_adds_epu8(above, one), _mm256_adds_epu8(row[s], one)),
+							_mm256_adds_epu8(diagonal, cost));
+						diagonal = above;
+					}
+				}
+				auto lengths = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(block + width * lanes));
+				auto best = row[0];
+				for (size_t s = 1; s <= width; s++)
+				{
+					auto within = _mm256_cmpeq_epi8(_mm256_max_epu8(lengths, _mm256_set1_epi8((char)s)), lengths);
+					best = _mm256_min_epu8(best, _mm256_or_si256(row[s], _mm256_andnot_si256(within, full)));
+				}
+				_mm256_storeu_si256(reinterpret_cast<__m256i*>(misMatch + b * lanes), best);
+			}
+		}
+#endif
+
+		/*!
+		Whether the processor and the operating system support AVX2
+		*/
+		static bool hasAvx2()
+		{
+#if defined(PACKED_X86) && defined(_MSC_VER)
+			int info[4];
+			__cpuid(info, 0);
+			if (info[0] < 7)
+				return false;
+			//AVX enabled by the processor, and its registers saved by the operating system
+			__cpuid(info, 1);
+			if ((info[2] & (1 << 27)) == 0 || (info[2] & (1 << 28)) == 0 || (_xgetbv(0) & 6) != 6)
+				return false;
+			__cpuidex(info, 7, 0);
+			return (info[1] & (1 << 5)) != 0;
+#elif defined(PACKED_X86)
+			return __builtin_cpu_supports("avx2");
+#else
+			return false;
+#endif
+		}
+
+		/*!
+		Whether the processor supports SSE2
+		*/
+		static bool hasSse2()
+		{
+#if defined(PACKED_X86) && (defined(_M_X64) || defined(__x86_64__))
+			return true;
+#elif defined(PACKED_X86) && defined(_MSC_VER)
+			int info[4];
+			__cpuid(info, 1);
+			return (info[3] & (1 << 26)) != 0;
+#elif defined(PACKED_X86)
+			return __builtin_cpu_supports("sse2");
+#else
+			return false;
+#endif
+		}
+
+		/*!
+		Selects the widest kernel the processor supports
+		*/
+		static Kernel selectKernel()
+		{
+#if defined(PACKED_X86)
+			if (hasAvx2())
+				return &PackedStrings::matchAvx2;
+			if (hasSse2())
+				return &PackedStrings::matchSse2;
+#endif
+			return &PackedStrings::matchScalar;
+		}
+
+	private:
+		/*!
+		Caps a distance to the range of a byte, as the SIMD kernels do
+		*/
+		static uint8_t saturate(unsigned value)
+		{
+			return (uint8_t)std::min(value, 255u);
+		}
+
+		size_t count = 0;
+		std::vector<uint8_t> blocks;
+	};
+};
+
+#endif
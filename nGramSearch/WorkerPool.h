@@ -0,0 +1,126 @@
+#ifndef WORKERPOOL_H
+#define WORKERPOOL_H
+
+#include <thread>
+#include <functional>
+#include <deque>
+#include <mutex>
+#include <condition_variable>
+#include <vector>
+#include <atomic>
+#include "FrozenArray.h"
+
+namespace StringSearch
+{
+	/*!
+	WorkerPool: A fixed set of threads running queued tasks in submission order
+	*/
+	class WorkerPool
+	{
+	public:
+		/*!
+		Starts the worker threads
+		@param threads The number of threads. 0 for one per hardware thread.
+		@param pinNodes Whether to spread the threads over the NUMA nodes, each pinned to the processors of its node,
+		so that the tasks read the memory local to their node.
+		*/
+		WorkerPool(size_t threads = 0, bool pinNodes = false) : pinNodes(pinNodes)
+		{
+			if (threads == 0)
+				threads = std::max(std::thread::hardware_concurrency(), 1u);
+			for (size_t i = 0; i < threads; i++)
+				workers.emplace_back(&WorkerPool::work, this, i);
+		}
+
+		/*!
+		Stops the pool, unless \p shutdown has already stopped it
+		*/
+		~WorkerPool()
+		{
+			shutdown();
+		}
+
+		/*!
+		Runs the tasks left in the queue, and joins the worker threads. Tasks submitted afterwards are never run.
+		Does nothing if the pool has already been stopped.
+		*/
+		void shutdown()
+		{
+			{
+				std::lock_guard<std::mutex> guard(lock);
+				if (stopping)
+					return;
+				stopping = true;
+			}
+			ready.notify_all();
+			for (auto& worker : workers)
+				worker.join();
+			workers.clear();
+		}
+
+		/*!
+		Queues a task to be run by a worker thread. Never blocks.
+		@param task The task to be run
+		*/
+		void submit(std::function<void()> task)
+		{
+			{
+				std::lock_guard<std::mutex> guard(lock);
+				tasks.push_back(std::move(task));
+			}
+			ready.notify_one();
+		}
+
+		/*!
+		Sets whether the threads are spread over the NUMA nodes. Each thread is pinned, or released, before its next task.
+		@param pin Whether to pin the threads, see the constructor
+		*/
+		void setPinNodes(bool pin)
+		{
+			pinNodes = pin;
+		}
+
+		/*!
+		Get the number of worker threads
+		*/
+		size_t size() const
+		{
+			return workers.size();
+		}
+
+	private:
+		/*!
+		The loop of a worker thread
+		@param worker The number of the thread, from 0
+		*/
+		void work(size_t worker)
+		{
+			auto& topology = NumaTopology::get();
+			bool pinned = false;
+			for (;;)
+			{
+				std::function<void()> task;
+				{
+					std::unique_lock<std::mutex> guard(lock);
+					ready.wait(guard, [this] { return stopping || !tasks.empty(); });
+					if (tasks.empty())
+						return;
+					task = std::move(tasks.front());
+					tasks.pop_front();
+				}
+				if (pinNodes != pinned && (pinned ? topology.unpin() : topology.pin(worker % topology.nodes())))
+					pinned = !pinned;
+				task();
+			}
+		}
+
+		std::vector<std::thread> workers;
+		std::deque<std::function<void()>> tasks;
+		std::mutex lock;
+		std::condition_variable ready;
+		bool stopping = false;
+		std::atomic<bool> pinNodes;
+	};
+};
+
+#endif
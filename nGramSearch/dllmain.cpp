@@ -1,6 +1,14 @@
 // dllmain.cpp : Defines the entry point for the DLL application.
 #include "nGramSearch.h"
 #include "nGramSearch.hpp"
+#include "WorkerPool.h"
+#include <cstdio>
+#include <fstream>
+#include <chrono>
+#if defined(__linux__)
+#include <sys/eventfd.h>
+#include <unistd.h>
+#endif
 
 #if defined(_MSC_VER)
 	//  MSVC
@@ -19,9 +27,317 @@
 using namespace std;
 using namespace StringSearch;
 
+//a library in the registry. Cold libraries are evicted to a snapshot on disk, and reloaded by the next access.
+struct IndexEntry
+{
+	//owns the library while it is resident. Replaced under loadLock, or under the unique mainLock
+	unique_ptr<StringIndex> index;
+	//the library, or nullptr while evicted. Read without loadLock
+	atomic<StringIndex*> resident{ nullptr };
+	std::mutex loadLock;
+
+	//path of the snapshot while evicted
+	string snapshot;
+	//set when the snapshot could not be reloaded, so that it is not parsed again by every later call
+	atomic<bool> failed{ false };
+
+	//cached so that they are served without a reload
+	uint64_t size = 0;
+	uint64_t libSize = 0;
+	atomic<uint64_t> footprint{ 0 };
+	SearchStats stats = SearchStats();
+	IndexStats indexStats = IndexStats();
+
+	//access tick of the last use, for the LRU eviction
+	atomic<uint64_t> lastAccess{ 0 };
+	//result arrays pointing into the library that have not been released. The library is not evicted meanwhile.
+	atomic<int64_t> outstanding{ 0 };
+};
+
 std::shared_mutex mainLock;
 //key entries for indexed StringIndex class instances
-unordered_map<uint32_t, unique_ptr<StringIndex>> indexed;
+unordered_map<uint32_t, unique_ptr<IndexEntry>> indexed;
+
+//time spent waiting for mainLock, and the number of contended acquisitions, reported by getLockStats
+atomic<uint64_t> lockWaitNanos{ 0 };
+atomic<uint64_t> lockContended{ 0 };
+
+/*!
+A lock on mainLock that accounts the time spent waiting for it. Uncontended acquisitions are not timed.
+@param Lock std::shared_lock or std::unique_lock
+*/
+template<typename Lock>
+struct TimedLock : Lock
+{
+	TimedLock(std::shared_mutex& mutex) : Lock(mutex, std::try_to_lock)
+	{
+		if (this->owns_lock())
+			return;
+		auto start = chrono::steady_clock::now();
+		this->lock();
+		lockWaitNanos += chrono::duration_cast<chrono::nanoseconds>(chrono::steady_clock::now() - start).count();
+		lockContended++;
+	}
+};
+
+//the memory budget of the resident libraries, 0 for unlimited, and the directory of the snapshots. Guarded by mainLock
+atomic<uint64_t> memoryBudget{ 0 };
+string snapshotDir;
+atomic<uint64_t> residentBytes{ 0 };
+atomic<uint64_t> accessTick{ 0 };
+
+//how the posting lists of the libraries are allocated, see setAllocation. Guarded by mainLock
+HugePages allocationPages = HugePagesOff;
+//also read by the executor, without mainLock
+atomic<bool> allocationPerNode{ false };
+
+/*!
+Moves the posting lists of a library just built or reloaded to the allocation set by \p setAllocation
+@param index The library
+*/
+void applyAllocation(StringIndex& index)
+{
+	if (allocationPages != HugePagesOff || allocationPerNode)
+		index.setAllocation(allocationPages, allocationPerNode);
+}
+
+/*!
+Finds the library of a handle, reloading it from its snapshot if it has been evicted. The caller must hold \p mainLock.
+@param handle A unique id for the indexed library
+@returns The library, or nullptr if it does not exist or cannot be reloaded. A library that failed to reload once is not retried.
+*/
+StringIndex* acquire(uint32_t handle)
+{
+	auto keyPair = indexed.find(handle);
+	if (keyPair == indexed.end() || !keyPair->second)
+		return nullptr;
+	auto& entry = *keyPair->second;
+	entry.lastAccess = ++accessTick;
+	auto index = entry.resident.load();
+	if (!index && !entry.failed)
+	{
+		lock_guard<std::mutex> guard(entry.loadLock);
+		index = entry.resident.load();
+		if (!index && !entry.failed)
+		{
+			ifstream in(entry.snapshot, ios::binary);
+			auto loaded = make_unique<StringIndex>(in);
+			in.close();
+			if (!loaded->isIndexed())
+			{
+				std::remove(entry.snapshot.c_str());
+				entry.snapshot.clear();
+				entry.failed = true;
+				return nullptr;
+			}
+			std::remove(entry.snapshot.c_str());
+			entry.snapshot.clear();
+			applyAllocation(*loaded);
+			//the counters carry on from where the evicted copy left them
+			loaded->resumeSearchStats(entry.stats);
+			entry.footprint = loaded->memoryUsage();
+			residentBytes += entry.footprint;
+			entry.index = move(loaded);
+			index = entry.index.get();
+			entry.resident = index;
+		}
+	}
+	return index;
+}
+
+/*!
+Keeps a library resident while a result array pointing into it has not been released. The caller must hold \p mainLock,
+from the \p acquire of the library until the array is handed out.
+@param handle A unique id for the indexed library
+@param results The result array handed out, or nullptr if the search allocated none, and then nothing is released
+*/
+void pin(uint32_t handle, char** results)
+{
+	auto keyPair = indexed.find(handle);
+	if (results && keyPair != indexed.end() && keyPair->second)
+		keyPair->second->outstanding++;
+}
+
+/*!
+Releases a library pinned by \p pin. The caller must hold \p mainLock.
+@param handle A unique id for the indexed library
+*/
+void unpin(uint32_t handle)
+{
+	auto keyPair = indexed.find(handle);
+	if (keyPair == indexed.end() || !keyPair->second)
+		return;
+	//results handed out before a library is reindexed under the same handle are not counted twice
+	auto& outstanding = keyPair->second->outstanding;
+	auto count = outstanding.load();
+	while (count > 0 && !outstanding.compare_exchange_weak(count, count - 1));
+}
+
+/*!
+Writes a library to a snapshot and frees it. The caller must hold \p mainLock uniquely.
+@param handle A unique id for the indexed library
+@param entry The registry entry of the library
+@returns Whether the library has been evicted
+*/
+bool evict(uint32_t handle, IndexEntry& entry)
+{
+	auto index = entry.resident.load();
+	if (!index || snapshotDir.empty())
+		return false;
+	auto path = snapshotDir + "/nGramSearch_" + to_string(handle) + ".snapshot";
+	{
+		ofstream out(path, ios::binary | ios::trunc);
+		if (!out || !index->save(out))
+		{
+			out.close();
+			std::remove(path.c_str());
+			return false;
+		}
+	}
+	index->searchStats(&entry.stats);
+	index->indexStats(&entry.indexStats);
+	entry.snapshot = path;
+	entry.resident = nullptr;
+	entry.index.reset();
+	residentBytes -= entry.footprint;
+	return true;
+}
+
+/*!
+Evicts the least recently used libraries until the resident ones fit in \p memoryBudget. The caller must hold \p mainLock uniquely.
+Libraries with unreleased results are kept.
+@param keep A library not to be evicted, e.g. the one just used. 0 for none.
+*/
+void enforceBudget(uint32_t keep)
+{
+	while (memoryBudget && residentBytes > memoryBudget)
+	{
+		uint32_t coldest = 0;
+		uint64_t coldestAccess = (numeric_limits<uint64_t>::max)();
+		for (auto& kp : indexed)
+		{
+			auto& entry = *kp.second;
+			if (kp.first != keep && entry.resident.load() && entry.outstanding == 0 && entry.lastAccess < coldestAccess)
+			{
+				coldest = kp.first;
+				coldestAccess = entry.lastAccess;
+			}
+		}
+		if (coldest == 0 || !evict(coldest, *indexed[coldest]))
+			return;
+	}
+}
+
+/*!
+Enforces \p memoryBudget after a library may have been reloaded. The caller must not hold \p mainLock.
+@param keep The library just used, not to be evicted
+*/
+void rebalance(uint32_t keep)
+{
+	if (!memoryBudget || residentBytes <= memoryBudget)
+		return;
+	TimedLock<unique_lock<shared_mutex>> updLock(mainLock);
+	enforceBudget(keep);
+}
+
+//a typeahead session, bound to the handle of the library it searches
+struct Session
+{
+	uint32_t handle;
+	std::mutex lock;
+	SessionState state;
+};
+
+std::mutex sessionLock;
+//key entries for the open typeahead sessions
+unordered_map<uint32_t, shared_ptr<Session>> sessions;
+
+/*!
+Called on a worker of the executor when an asynchronous search completes
+@param userData The pointer passed to \p searchAsync
+@param request The id returned by \p searchAsync
+@param results The matching strings, sorted from highest score to lowest. Must call \p release to clean up after use.
+@param scores The scores of \p results
+@param size The length of \p results
+*/
+typedef void (*SearchCallback)(void* userData, uint64_t request, char** results, float* scores, uint32_t size);
+
+//a completed search, delivered by pollCompletions
+struct Completion
+{
+	uint64_t request;
+	void* userData;
+	uint32_t handle;
+	uint32_t size;
+	char** results;
+	float* scores;
+};
+
+//a bounded queue of completed searches, drained by pollCompletions
+struct CompletionQueue
+{
+	std::mutex lock;
+	std::deque<Completion> done;
+	//searches submitted and not polled yet, bounded by depth
+	uint32_t pending = 0;
+	uint32_t depth = 0;
+	//eventfd signalled while completions are waiting, or -1
+	int eventFd = -1;
+	//set by destroyCompletionQueue. Searches completing afterwards release their results
+	bool closed = false;
+};
+
+std::mutex queueLock;
+//key entries for the completion queues
+unordered_map<uint32_t, shared_ptr<CompletionQueue>> completionQueues;
+
+//searches in flight through searchAsync, bounded by asyncDepth
+atomic<uint32_t> asyncPending{ 0 };
+atomic<uint32_t> asyncDepth{ 1024 };
+atomic<uint64_t> requestCount{ 0 };
+
+//the executor of the asynchronous searches, started by the first one and stopped by shutdownAsync
+std::mutex executorLock;
+unique_ptr<WorkerPool> executor;
+
+/*!
+Queues a task on the executor, starting it if needed
+@param task The task to be run
+*/
+void submitAsync(function<void()> task)
+{
+	lock_guard<std::mutex> guard(executorLock);
+	if (!executor)
+		executor = make_unique<WorkerPool>();
+	//spread over the NUMA nodes while there is a copy of the posting lists on each, so that each search reads the copy of its node,
+	//see setAllocation. Otherwise the threads are left free to run anywhere.
+	executor->setPinNodes(allocationPerNode);
+	executor->submit(move(task));
+}
+
+/*!
+Runs a search on a worker of the executor
+@param handle A unique id for the indexed library
+@param query The query string
+@param threshold Lowest acceptable matching %, as a value between 0 and 1
+@param limit Maximum results generated
+@param completion Filled with the results
+*/
+void runAsync(uint32_t handle, const string& query, float threshold, uint32_t limit, Completion& completion)
+{
+	completion.handle = handle;
+	completion.size = 0;
+	completion.results = nullptr;
+	completion.scores = nullptr;
+	{
+		TimedLock<shared_lock<shared_mutex>> sharedLock(mainLock);
+		auto index = acquire(handle);
+		if (index)
+			completion.size = index->score(query.c_str(), &completion.results, &completion.scores, threshold, limit, SearchSingleThread);
+		pin(handle, completion.results);
+	}
+	rebalance(handle);
+}
 
 
 /*!
@@ -36,7 +352,7 @@ In a search, all queries of the words in a row will return the master key.
 */
 DLLEXP uint32_t indexN(char** const words, const uint64_t size, const uint16_t rowSize, float* const weight)
 {
-	unique_lock<shared_mutex> updLock(mainLock);
+	TimedLock<unique_lock<shared_mutex>> updLock(mainLock);
 	//0 is reserved to represent an empty handle
 	uint32_t handle = 1;
 	const uint32_t maxVal = (numeric_limits<uint32_t>::max)();
@@ -44,7 +360,17 @@ DLLEXP uint32_t indexN(char** const words, const uint64_t size, const uint16_t r
 		handle++;
 	if (handle == maxVal)
 		return 0;
-	indexed.emplace(handle, make_unique<StringIndex>(words, (size_t)size, rowSize, weight));
+	auto entry = make_unique<IndexEntry>();
+	entry->index = make_unique<StringIndex>(words, (size_t)size, rowSize, weight);
+	applyAllocation(*entry->index);
+	entry->resident = entry->index.get();
+	entry->size = entry->index->size();
+	entry->libSize = entry->index->libSize();
+	entry->footprint = entry->index->memoryUsage();
+	entry->lastAccess = ++accessTick;
+	residentBytes += entry->footprint;
+	indexed.emplace(handle, move(entry));
+	enforceBudget(handle);
 	return handle;
 }
 
@@ -60,13 +386,17 @@ Must call \p release to clean up after use.
 */
 DLLEXP uint32_t search(uint32_t handle, const char* query, char*** results, float threshold, uint32_t limit)
 {
-	shared_lock<shared_mutex> sharedLock(mainLock);
-	auto pkeyPair = indexed.find(handle);
-	if (pkeyPair != indexed.end() && pkeyPair->second)
+	uint32_t size = 0;
 	{
-		return pkeyPair->second->search(query, results, threshold, limit);
+		TimedLock<shared_lock<shared_mutex>> sharedLock(mainLock);
+		*results = nullptr;
+		auto index = acquire(handle);
+		if (index)
+			size = index->search(query, results, threshold, limit);
+		pin(handle, *results);
 	}
-	return 0;
+	rebalance(handle);
+	return size;
 }
 
 /*!
@@ -81,11 +411,116 @@ Must call \p release to clean up after use.
 */
 DLLEXP uint32_t score(uint32_t handle, const char* query, char*** results, float** scores, float threshold, uint32_t limit)
 {
-	shared_lock<shared_mutex> sharedLock(mainLock);
-	auto pkeyPair = indexed.find(handle);
-	if (pkeyPair != indexed.end() && pkeyPair->second)
+	uint32_t size = 0;
 	{
-		return pkeyPair->second->score(query, results, scores, threshold, limit);
+		TimedLock<shared_lock<shared_mutex>> sharedLock(mainLock);
+		*results = nullptr;
+		auto index = acquire(handle);
+		if (index)
+			size = index->score(query, results, scores, threshold, limit);
+		pin(handle, *results);
+	}
+	rebalance(handle);
+	return size;
+}
+
+/*!
+Search the query in the indexed library identified by the guid, with options.
+@param handle A unique id for the indexed library
+@param query The query string
+@param results The pointer to a string array for output. The memory will be allocated by new.
+Must call \p release to clean up after use.
+@param scores The pointer to a score array for output, or nullptr if the scores are not needed.
+@param threshold Lowest acceptable matching %, as a value between 0 and 1
+@param limit Maximum results generated
+@param flags A combination of \p SearchFlags, e.g. 1 for an approximate search over the LSH bands built by \p buildLsh
+*/
+DLLEXP uint32_t searchEx(uint32_t handle, const char* query, char*** results, float** scores, float threshold, uint32_t limit, uint32_t flags)
+{
+	uint32_t size = 0;
+	{
+		TimedLock<shared_lock<shared_mutex>> sharedLock(mainLock);
+		*results = nullptr;
+		auto index = acquire(handle);
+		if (index && scores)
+			size = index->score(query, results, scores, threshold, limit, flags);
+		else if (index)
+			size = index->search(query, results, threshold, limit, flags);
+		pin(handle, *results);
+	}
+	rebalance(handle);
+	return size;
+}
+
+//the libraries pinned by each result array of searchMulti, as they are released by releaseMulti
+std::mutex multiLock;
+unordered_map<char**, vector<uint32_t>> multiPins;
+
+/*!
+Search the query in several indexed libraries at once, and merge their results into a single list.
+The query is normalised once, and the libraries are searched in parallel.
+@param handles The ids of the indexed libraries. Libraries that do not exist are skipped.
+@param weights The multiplier of the scores of each library, or nullptr to weight them equally
+@param count The number of libraries in \p handles
+@param query The query string
+@param results The pointer to a string array for output, sorted from highest weighted score to lowest. The memory will be allocated by new.
+Must call \p releaseMulti to clean up after use.
+@param scores The pointer to a weighted score array for output, or nullptr if the scores are not needed.
+@param sources The pointer to an array for output, the position in \p handles of the library of each result, or nullptr if not needed.
+@param threshold Lowest acceptable matching %, as a value between 0 and 1, before weighting
+@param limit Maximum results generated in total
+@param flags A combination of \p SearchFlags
+*/
+DLLEXP uint32_t searchMulti(const uint32_t* handles, const float* weights, uint32_t count, const char* query, char*** results, float** scores,
+	uint32_t** sources, float threshold, uint32_t limit, uint32_t flags)
+{
+	if (!handles || !query)
+		return 0;
+	uint32_t size = 0;
+	{
+		TimedLock<shared_lock<shared_mutex>> sharedLock(mainLock);
+		vector<const StringIndex*> indexes(count);
+		for (uint32_t i = 0; i < count; i++)
+			indexes[i] = acquire(handles[i]);
+		*results = nullptr;
+		size = StringIndex::searchMulti(indexes.data(), weights, count, query, results, scores, sources, threshold, limit, flags);
+		if (*results)
+		{
+			//only the libraries found are pinned, and releaseMulti unpins exactly those
+			vector<uint32_t> pinned;
+			for (uint32_t i = 0; i < count; i++)
+				if (indexes[i])
+				{
+					pin(handles[i], *results);
+					pinned.push_back(handles[i]);
+				}
+			lock_guard<std::mutex> guard(multiLock);
+			multiPins[*results] = move(pinned);
+		}
+	}
+	//the libraries searched are pinned by the results, so none of them needs to be kept apart
+	rebalance(0);
+	return size;
+}
+
+/*!
+To build the LSH bands of an indexed library for approximate searches. Replaces the bands built before.
+@param handle A unique id for the indexed library
+@param bands The number of bands. More bands raise the recall. 0 to drop the bands.
+@param rows The number of MinHash values in each band. More rows cut the number of candidates scored.
+*/
+DLLEXP void buildLsh(uint32_t handle, uint16_t bands, uint16_t rows)
+{
+	TimedLock<unique_lock<shared_mutex>> updLock(mainLock);
+	auto index = acquire(handle);
+	if (index)
+	{
+		auto& entry = *indexed[handle];
+		index->buildLsh(bands, rows);
+		residentBytes -= entry.footprint;
+		entry.footprint = index->memoryUsage();
+		residentBytes += entry.footprint;
+		enforceBudget(handle);
 	}
 }
 
@@ -97,10 +532,261 @@ To release the memory allocated for the result in the \p search function
 */
 DLLEXP void release(uint32_t handle, char** results, float* scores)
 {
-	shared_lock<shared_mutex> sharedLock(mainLock);
+	TimedLock<shared_lock<shared_mutex>> sharedLock(mainLock);
 	auto keyPair = indexed.find(handle);
 	if (keyPair != indexed.end() && keyPair->second)
-		keyPair->second->release(results, scores);
+	{
+		StringIndex::release(results, scores);
+		//a search that handed out no result array has not pinned the library
+		if (results)
+			unpin(handle);
+	}
+}
+
+/*!
+To release the memory allocated for the result in the \p searchMulti function. The libraries pinned by the search are released,
+as recorded with \p results, so a library that did not exist at the time of the search is left alone.
+@param results The result returned by the \p searchMulti function.
+@param scores The scores returned by the \p searchMulti function, or nullptr.
+@param sources The sources returned by the \p searchMulti function, or nullptr.
+*/
+DLLEXP void releaseMulti(char** results, float* scores, uint32_t* sources)
+{
+	TimedLock<shared_lock<shared_mutex>> sharedLock(mainLock);
+	vector<uint32_t> pinned;
+	if (results)
+	{
+		lock_guard<std::mutex> guard(multiLock);
+		auto found = multiPins.find(results);
+		if (found != multiPins.end())
+		{
+			pinned = move(found->second);
+			multiPins.erase(found);
+		}
+	}
+	StringIndex::release(results, scores, sources);
+	for (auto handle : pinned)
+		unpin(handle);
+}
+
+/*!
+Search the query in the indexed library without blocking. The search runs on the executor of the library,
+and \p callback is called on the executor thread with the results.
+@param handle A unique id for the indexed library
+@param query The query string, copied before the call returns
+@param threshold Lowest acceptable matching %, as a value between 0 and 1
+@param limit Maximum results generated
+@param callback Called when the search completes, even if the library does not exist
+@param userData Passed to \p callback
+@returns A non-zero id of the request, or 0 if \p setAsyncDepth searches are already in flight
+*/
+DLLEXP uint64_t searchAsync(uint32_t handle, const char* query, float threshold, uint32_t limit, SearchCallback callback, void* userData)
+{
+	if (!callback || !query)
+		return 0;
+	//back-pressure: reserve a slot, or reject
+	auto pending = asyncPending.load();
+	do
+	{
+		if (pending >= asyncDepth)
+			return 0;
+	} while (!asyncPending.compare_exchange_weak(pending, pending + 1));
+
+	auto request = ++requestCount;
+	string queryStr(query);
+	submitAsync([=]() {
+		Completion completion;
+		runAsync(handle, queryStr, threshold, limit, completion);
+		asyncPending--;
+		callback(userData, request, completion.results, completion.scores, completion.size);
+	});
+	return request;
+}
+
+/*!
+To set the maximum number of searches in flight through \p searchAsync. Further searches are rejected until some complete.
+@param depth The maximum number of searches in flight. Default 1024.
+*/
+DLLEXP void setAsyncDepth(uint32_t depth)
+{
+	asyncDepth = depth;
+}
+
+/*!
+To stop the executor of the asynchronous searches: the searches already submitted are run and their callbacks called, or their
+completions queued, and its threads are joined. Must be called before the library is unloaded, e.g. by FreeLibrary, as the threads
+cannot be joined while the loader lock is held on unload, nor after they have been ended at process exit.
+A later asynchronous search starts the executor again.
+*/
+DLLEXP void shutdownAsync()
+{
+	unique_ptr<WorkerPool> stopped;
+	{
+		lock_guard<std::mutex> guard(executorLock);
+		stopped = move(executor);
+	}
+	//joined without executorLock, so that new searches start another executor rather than wait for this one
+	if (stopped)
+		stopped->shutdown();
+}
+
+/*!
+To create a completion queue, the polling alternative to the callbacks of \p searchAsync.
+@param depth The maximum number of searches submitted to the queue and not polled yet
+@returns handle to the queue
+*/
+DLLEXP uint32_t createCompletionQueue(uint32_t depth)
+{
+	auto queue = make_shared<CompletionQueue>();
+	queue->depth = depth;
+#if defined(__linux__)
+	queue->eventFd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+#endif
+	lock_guard<std::mutex> guard(queueLock);
+	//0 is reserved to represent an empty handle
+	uint32_t handle = 1;
+	const uint32_t maxVal = (numeric_limits<uint32_t>::max)();
+	while (completionQueues.find(handle) != completionQueues.end() && handle < maxVal)
+		handle++;
+	if (handle == maxVal)
+		return 0;
+	completionQueues.emplace(handle, move(queue));
+	return handle;
+}
+
+/*!
+Search the query in the indexed library without blocking, and deliver the results to a completion queue.
+@param queue A handle returned by \p createCompletionQueue
+@param handle A unique id for the indexed library
+@param query The query string, copied before the call returns
+@param threshold Lowest acceptable matching %, as a value between 0 and 1
+@param limit Maximum results generated
+@param userData Delivered with the completion
+@returns A non-zero id of the request, or 0 if the queue is full or does not exist
+*/
+DLLEXP uint64_t searchQueued(uint32_t queue, uint32_t handle, const char* query, float threshold, uint32_t limit, void* userData)
+{
+	shared_ptr<CompletionQueue> target;
+	{
+		lock_guard<std::mutex> guard(queueLock);
+		auto found = completionQueues.find(queue);
+		if (found == completionQueues.end() || !query)
+			return 0;
+		target = found->second;
+	}
+	{
+		lock_guard<std::mutex> guard(target->lock);
+		if (target->pending >= target->depth)
+			return 0;
+		target->pending++;
+	}
+
+	auto request = ++requestCount;
+	string queryStr(query);
+	submitAsync([=]() {
+		Completion completion;
+		completion.request = request;
+		completion.userData = userData;
+		runAsync(handle, queryStr, threshold, limit, completion);
+		unique_lock<std::mutex> guard(target->lock);
+		if (target->closed)
+		{
+			guard.unlock();
+			release(handle, completion.results, completion.scores);
+			return;
+		}
+		target->done.push_back(completion);
+#if defined(__linux__)
+		if (target->eventFd >= 0)
+		{
+			uint64_t one = 1;
+			auto written = write(target->eventFd, &one, sizeof(one));
+			(void)written;
+		}
+#endif
+	});
+	return request;
+}
+
+/*!
+To take the completed searches from a completion queue without blocking.
+@param queue A handle returned by \p createCompletionQueue
+@param completions The array to be filled
+@param max The length of \p completions
+@returns The number of completions filled. Must call \p release with their handle to clean up their results.
+*/
+DLLEXP uint32_t pollCompletions(uint32_t queue, Completion* completions, uint32_t max)
+{
+	shared_ptr<CompletionQueue> target;
+	{
+		lock_guard<std::mutex> guard(queueLock);
+		auto found = completionQueues.find(queue);
+		if (found == completionQueues.end() || !completions)
+			return 0;
+		target = found->second;
+	}
+	lock_guard<std::mutex> guard(target->lock);
+	uint32_t size = 0;
+	while (size < max && !target->done.empty())
+	{
+		completions[size++] = target->done.front();
+		target->done.pop_front();
+	}
+	target->pending -= size;
+#if defined(__linux__)
+	//reset the eventfd once drained, under the lock so that no completion is missed
+	if (target->done.empty() && target->eventFd >= 0)
+	{
+		uint64_t count;
+		auto drained = read(target->eventFd, &count, sizeof(count));
+		(void)drained;
+	}
+#endif
+	return size;
+}
+
+/*!
+To obtain a file descriptor that is readable while completions are waiting in a completion queue, e.g. for epoll.
+@param queue A handle returned by \p createCompletionQueue
+@returns The eventfd of the queue, or -1 where eventfd is not supported, in which case the queue must be polled
+*/
+DLLEXP int getCompletionFd(uint32_t queue)
+{
+	lock_guard<std::mutex> guard(queueLock);
+	auto found = completionQueues.find(queue);
+	if (found == completionQueues.end())
+		return -1;
+	return found->second->eventFd;
+}
+
+/*!
+To destroy a completion queue. Results not polled yet are released, and searches in flight are dropped when they complete.
+@param queue A handle returned by \p createCompletionQueue
+*/
+DLLEXP void destroyCompletionQueue(uint32_t queue)
+{
+	shared_ptr<CompletionQueue> target;
+	{
+		lock_guard<std::mutex> guard(queueLock);
+		auto found = completionQueues.find(queue);
+		if (found == completionQueues.end())
+			return;
+		target = found->second;
+		completionQueues.erase(found);
+	}
+	std::deque<Completion> done;
+	{
+		lock_guard<std::mutex> guard(target->lock);
+		target->closed = true;
+		done.swap(target->done);
+#if defined(__linux__)
+		if (target->eventFd >= 0)
+			close(target->eventFd);
+#endif
+		target->eventFd = -1;
+	}
+	for (auto& completion : done)
+		release(completion.handle, completion.results, completion.scores);
 }
 
 /*!
@@ -109,44 +795,302 @@ To dispose a library indexed. If the library does not exist, \p dispose will ign
 */
 DLLEXP void dispose(uint32_t handle)
 {
-	unique_lock<shared_mutex> updLock(mainLock);
-	indexed.erase(handle);
+	TimedLock<unique_lock<shared_mutex>> updLock(mainLock);
+	auto keyPair = indexed.find(handle);
+	if (keyPair == indexed.end())
+		return;
+	auto& entry = *keyPair->second;
+	if (entry.resident.load())
+		residentBytes -= entry.footprint;
+	else if (!entry.snapshot.empty())
+		std::remove(entry.snapshot.c_str());
+	indexed.erase(keyPair);
+}
+
+/*!
+To open a typeahead session on an indexed library. Each keystroke is then sent to \p extendQuery.
+@param handle A unique id for the indexed library
+@returns handle to the session, or 0 if the library does not exist
+*/
+DLLEXP uint32_t openSession(uint32_t handle)
+{
+	{
+		TimedLock<shared_lock<shared_mutex>> sharedLock(mainLock);
+		if (indexed.find(handle) == indexed.end())
+			return 0;
+	}
+	lock_guard<std::mutex> guard(sessionLock);
+	//0 is reserved to represent an empty handle
+	uint32_t session = 1;
+	const uint32_t maxVal = (numeric_limits<uint32_t>::max)();
+	while (sessions.find(session) != sessions.end() && session < maxVal)
+		session++;
+	if (session == maxVal)
+		return 0;
+	auto created = make_shared<Session>();
+	created->handle = handle;
+	sessions.emplace(session, move(created));
+	return session;
+}
+
+/*!
+To append characters to the query of a typeahead session, and search for the whole query.
+Only the characters added are scored, unless the query no longer extends the previous one, e.g. after a trailing space is trimmed.
+@param session A unique id for the session
+@param text The characters typed
+@param results The pointer to a string array for output. The memory will be allocated by new.
+Must call \p release with the handle of the library to clean up after use.
+@param scores The pointer to a score array for output, or nullptr if the scores are not needed.
+@param threshold Lowest acceptable matching %, as a value between 0 and 1
+@param limit Maximum results generated
+*/
+DLLEXP uint32_t extendQuery(uint32_t session, const char* text, char*** results, float** scores, float threshold, uint32_t limit)
+{
+	shared_ptr<Session> current;
+	{
+		lock_guard<std::mutex> guard(sessionLock);
+		auto found = sessions.find(session);
+		if (found == sessions.end())
+			return 0;
+		current = found->second;
+	}
+	lock_guard<std::mutex> guard(current->lock);
+	uint32_t size = 0;
+	{
+		TimedLock<shared_lock<shared_mutex>> sharedLock(mainLock);
+		*results = nullptr;
+		auto index = acquire(current->handle);
+		if (index)
+			size = index->extend(current->state, text, results, scores, threshold, limit);
+		pin(current->handle, *results);
+	}
+	rebalance(current->handle);
+	return size;
+}
+
+/*!
+To close a typeahead session. If the session does not exist, \p closeSession will ignore it.
+@param session A unique id for the session
+*/
+DLLEXP void closeSession(uint32_t session)
+{
+	lock_guard<std::mutex> guard(sessionLock);
+	sessions.erase(session);
 }
 
 /*!
-To obtain the current word map size
+To obtain the current word map size. An evicted library is not reloaded.
 @param handle A unique id for the indexed library
 */
 DLLEXP uint64_t getSize(uint32_t handle)
 {
-	shared_lock<shared_mutex> sharedLock(mainLock);
+	TimedLock<shared_lock<shared_mutex>> sharedLock(mainLock);
 	auto keyPair = indexed.find(handle);
 	if (keyPair != indexed.end() && keyPair->second)
-		return keyPair->second->size();
+		return keyPair->second->size;
 	return 0;
 }
 
 /*!
-To obtain the current n-gram library size.
+To obtain the current n-gram library size. An evicted library is not reloaded.
 @param guid A unique id for the indexed library
 */
 DLLEXP uint64_t getLibSize(uint32_t handle)
 {
-	shared_lock<shared_mutex> sharedLock(mainLock);
+	TimedLock<shared_lock<shared_mutex>> sharedLock(mainLock);
+	auto keyPair = indexed.find(handle);
+	if (keyPair != indexed.end() && keyPair->second)
+		return keyPair->second->libSize;
+	return 0;
+}
+
+/*!
+To obtain the estimated memory held by an indexed library, whether it is resident or evicted. An evicted library is not reloaded.
+@param handle A unique id for the indexed library
+*/
+DLLEXP uint64_t getMemoryUsage(uint32_t handle)
+{
+	TimedLock<shared_lock<shared_mutex>> sharedLock(mainLock);
 	auto keyPair = indexed.find(handle);
 	if (keyPair != indexed.end() && keyPair->second)
-		return keyPair->second->libSize();
+		return keyPair->second->footprint;
 	return 0;
 }
 
+/*!
+To obtain whether an indexed library is resident, i.e. has not been evicted to its snapshot.
+@param handle A unique id for the indexed library
+*/
+DLLEXP bool isResident(uint32_t handle)
+{
+	TimedLock<shared_lock<shared_mutex>> sharedLock(mainLock);
+	auto keyPair = indexed.find(handle);
+	return keyPair != indexed.end() && keyPair->second && keyPair->second->resident.load();
+}
+
+/*!
+To set the memory budget of all indexed libraries. Beyond the budget, the least recently used libraries are
+written to a snapshot in \p directory and freed, and they are reloaded by their next search.
+Libraries with unreleased results are not evicted.
+@param bytes The memory budget in bytes, as estimated by \p getMemoryUsage. 0 for unlimited.
+@param directory A local directory for the snapshots, private to the process. Nothing is evicted without it.
+*/
+DLLEXP void setMemoryBudget(uint64_t bytes, const char* directory)
+{
+	TimedLock<unique_lock<shared_mutex>> updLock(mainLock);
+	memoryBudget = bytes;
+	snapshotDir = directory ? directory : "";
+	enforceBudget(0);
+}
+
+/*!
+To set how the posting lists of all indexed libraries are allocated, including the ones indexed or reloaded later.
+Replicas on each NUMA node are read by the searches running on that node, e.g. on the workers of the asynchronous searches,
+which are spread over the nodes while there are replicas, and run anywhere otherwise.
+@param hugePages 0 for regular pages, 1 for transparent huge pages, 2 for huge pages reserved by the administrator.
+@param perNode Whether to keep one copy of the posting lists per NUMA node. Multiplies their memory by the number of nodes.
+*/
+DLLEXP void setAllocation(uint8_t hugePages, bool perNode)
+{
+	TimedLock<unique_lock<shared_mutex>> updLock(mainLock);
+	allocationPages = hugePages > HugePagesExplicit ? HugePagesOff : (HugePages)hugePages;
+	allocationPerNode = perNode;
+	for (auto& kp : indexed)
+	{
+		auto index = kp.second->resident.load();
+		if (!index || !index->setAllocation(allocationPages, allocationPerNode))
+			continue;
+		residentBytes -= kp.second->footprint;
+		kp.second->footprint = index->memoryUsage();
+		residentBytes += kp.second->footprint;
+	}
+	enforceBudget(0);
+}
+
+/*!
+To obtain the query statistics of an indexed library, e.g. the fraction of n-gram postings skipped by length pruning.
+@param handle A unique id for the indexed library
+@param stats The statistics to be filled. Left untouched if the library does not exist.
+*/
+DLLEXP void getSearchStats(uint32_t handle, SearchStats* stats)
+{
+	TimedLock<shared_lock<shared_mutex>> sharedLock(mainLock);
+	auto keyPair = indexed.find(handle);
+	if (keyPair == indexed.end() || !keyPair->second || !stats)
+		return;
+	auto index = keyPair->second->resident.load();
+	if (index)
+		index->searchStats(stats);
+	else
+		*stats = keyPair->second->stats;
+}
+
+/*!
+To obtain the memory and shape statistics of an indexed library, e.g. the bytes held by each structure and the heaviest n-grams.
+They are collected when the library is built, so they are cheap to poll. An evicted library is not reloaded.
+@param handle A unique id for the indexed library
+@param stats The statistics to be filled. Left untouched if the library does not exist.
+*/
+DLLEXP void getIndexStats(uint32_t handle, IndexStats* stats)
+{
+	TimedLock<shared_lock<shared_mutex>> sharedLock(mainLock);
+	auto keyPair = indexed.find(handle);
+	if (keyPair == indexed.end() || !keyPair->second || !stats)
+		return;
+	auto index = keyPair->second->resident.load();
+	if (index)
+		index->indexStats(stats);
+	else
+		*stats = keyPair->second->indexStats;
+}
+
+/*!
+To obtain how a query would be searched, i.e. the strategy picked for the short and the long strings and their estimated costs.
+Nothing is searched. An evicted library is reloaded.
+@param handle A unique id for the indexed library
+@param query The query string
+@param threshold Lowest acceptable matching %, as a value between 0 and 1
+@param flags A combination of \p SearchFlags, as passed to \p searchEx
+@param plan The plan to be filled. Left untouched if the library does not exist.
+*/
+DLLEXP void explain(uint32_t handle, const char* query, float threshold, uint32_t flags, SearchPlan* plan)
+{
+	TimedLock<shared_lock<shared_mutex>> sharedLock(mainLock);
+	auto index = acquire(handle);
+	if (index && plan)
+		*plan = index->explain(query, threshold, flags);
+}
+
+/*!
+To adjust the quality/latency trade-off of the n-gram search of an indexed library.
+@param handle A unique id for the indexed library
+@param mode 0 to score by the ratio of query grams found, 1 to weight each gram by its inverse document frequency
+@param maxFrequency Grams found in more than this fraction of the long strings are ignored as stop grams. 1 to keep all grams.
+*/
+DLLEXP void setScoring(uint32_t handle, uint8_t mode, float maxFrequency)
+{
+	//the mode and the cap are set one after the other, so no search may run meanwhile and see one without the other
+	TimedLock<unique_lock<shared_mutex>> updLock(mainLock);
+	auto index = acquire(handle);
+	if (index)
+		index->setScoring(mode == GramIdf ? GramIdf : GramRatio, maxFrequency);
+}
+
 DLLEXP void setValidChar(uint32_t handle, char* const characters, int n)
 {
 	std::unordered_set<char> newValidChar(n);
 	for (int i = 0; i < n; i++)
 		newValidChar.insert(characters[i]);
-	shared_lock<shared_mutex> sharedLock(mainLock);
-	auto keyPair = indexed.find(handle);
-	if (keyPair != indexed.end() && keyPair->second)
-		keyPair->second->setValidChar(newValidChar);
+	//the exact match table is rebuilt, so no search may run meanwhile
+	TimedLock<unique_lock<shared_mutex>> updLock(mainLock);
+	auto index = acquire(handle);
+	if (index)
+	{
+		auto& entry = *indexed[handle];
+		index->setValidChar(newValidChar);
+		residentBytes -= entry.footprint;
+		entry.footprint = index->memoryUsage();
+		residentBytes += entry.footprint;
+	}
 }
 
+/*!
+To compress the strings of an indexed library, i.e. sort and front-code them, or to decode them back.
+A compressed library decodes its strings when it scans them or returns them, so searches take longer but the library takes less memory.
+@param handle A unique id for the indexed library
+@param compressed Whether to compress the strings
+@returns Whether the strings are stored as asked. Not compressed while results of the library have not been released,
+as they point into its strings.
+*/
+DLLEXP bool setStringPool(uint32_t handle, bool compressed)
+{
+	//the strings are replaced, so no search may run meanwhile
+	TimedLock<unique_lock<shared_mutex>> updLock(mainLock);
+	auto index = acquire(handle);
+	if (!index)
+		return false;
+	auto& entry = *indexed[handle];
+	if (compressed && entry.outstanding > 0)
+		return false;
+	index->setStringPool(compressed);
+	residentBytes -= entry.footprint;
+	entry.footprint = index->memoryUsage();
+	residentBytes += entry.footprint;
+	enforceBudget(handle);
+	return true;
+}
+
+/*!
+To obtain the time spent waiting for the registry lock, shared by all exports. Only the contended waits are measured: an acquisition
+that gets the lock at once, by try_lock, is neither timed nor counted, so \p waitNanos / \p contended is the mean contended wait,
+not the mean wait of all acquisitions.
+@param waitNanos Output the total wait in nanoseconds of the contended acquisitions
+@param contended Output the number of acquisitions that found the lock taken and had to wait
+*/
+DLLEXP void getLockStats(uint64_t* waitNanos, uint64_t* contended)
+{
+	if (waitNanos)
+		*waitNanos = lockWaitNanos;
+	if (contended)
+		*contended = lockContended;
+}
@@ -9,6 +9,7 @@
 #include <unordered_set>
 #include <algorithm>
 #include <future>
+#include <thread>
 #include <shared_mutex>
 #include <memory>
 #include <mutex>
@@ -17,6 +18,15 @@
 #include <algorithm>
 #include <cstring>
 #include <vector>
+#include <istream>
+#include <ostream>
+#include "FrozenArray.h"
+#include "PackedStrings.h"
+#include "BitSlicedCounter.h"
+#include "FrontCodedPool.h"
+#if defined(_MSC_VER)
+#include <intrin.h>
+#endif
 
 #undef max
 #undef min
@@ -97,6 +107,331 @@ namespace StringSearch
 				ch = ' ';
 	}
 
+	/*!
+	Mixes the bits of a 64-bit value, as in the finalizer of splitmix64
+	@param x The value to be mixed
+	*/
+	inline uint64_t mix64(uint64_t x)
+	{
+		x ^= x >> 30;
+		x *= 0xbf58476d1ce4e5b9ULL;
+		x ^= x >> 27;
+		x *= 0x94d049bb133111ebULL;
+		x ^= x >> 31;
+		return x;
+	}
+
+	/*!
+	Writes a trivially copyable value to a binary stream
+	@param out The stream to write to
+	@param value The value to be written
+	*/
+	template<typename T>
+	inline void writeValue(std::ostream& out, const T& value)
+	{
+		out.write(reinterpret_cast<const char*>(&value), sizeof(T));
+	}
+
+	/*!
+	Reads a trivially copyable value from a binary stream written by \p writeValue
+	@param in The stream to read from
+	@param value The value to be read
+	*/
+	template<typename T>
+	inline void readValue(std::istream& in, T& value)
+	{
+		in.read(reinterpret_cast<char*>(&value), sizeof(T));
+	}
+
+	/*!
+	Writes a vector of trivially copyable values to a binary stream, prefixed by its size
+	@param out The stream to write to
+	@param values The values to be written
+	*/
+	template<typename T>
+	inline void writeVector(std::ostream& out, const std::vector<T>& values)
+	{
+		writeValue(out, (uint64_t)values.size());
+		out.write(reinterpret_cast<const char*>(values.data()), values.size() * sizeof(T));
+	}
+
+	/*!
+	Reads a vector of trivially copyable values from a binary stream written by \p writeVector
+	@param in The stream to read from
+	@param values The values to be read
+	*/
+	template<typename T>
+	inline void readVector(std::istream& in, std::vector<T>& values)
+	{
+		uint64_t size = 0;
+		readValue(in, size);
+		if (!in)
+			return;
+		values.resize((size_t)size);
+		in.read(reinterpret_cast<char*>(values.data()), values.size() * sizeof(T));
+	}
+
+	/*!
+	Estimates the heap bytes held by a node-based hash map, excluding what its values own
+	@param map The hash map
+	*/
+	template<typename Map>
+	inline uint64_t hashMapBytes(const Map& map)
+	{
+		//a bucket pointer, and a node of the value, the next pointer and the cached hash
+		return map.bucket_count() * sizeof(void*) + map.size() * (sizeof(typename Map::value_type) + 2 * sizeof(void*));
+	}
+
+	/*!
+	Estimates the heap bytes held by a string. Short strings are stored in place.
+	@param str The string
+	*/
+	inline uint64_t stringBytes(const std::string& str)
+	{
+		return str.capacity() > 15 ? str.capacity() + 1 : 0;
+	}
+
+	/*!
+	Query statistics of an indexed library, exported through \p getSearchStats
+	*/
+	struct SearchStats
+	{
+		//! Number of queries served
+		uint64_t queries;
+		//! Number of n-gram postings scored by \p searchLong
+		uint64_t postingsVisited;
+		//! Number of n-gram postings skipped because their strings are too short to reach the threshold
+		uint64_t postingsSkipped;
+		//! postingsSkipped / (postingsVisited + postingsSkipped)
+		double skippedRatio;
+		//! Number of query grams ignored as stop grams, see \p setScoring
+		uint64_t stopGramsSkipped;
+		//! Number of n-gram postings belonging to the stop grams ignored
+		uint64_t stopPostingsSkipped;
+		//! Number of candidates retrieved from the LSH bands and scored by \p searchLsh
+		uint64_t lshCandidates;
+	};
+
+	//! Number of the heaviest grams reported by \p IndexStats
+	const size_t statsTopGrams = 8;
+
+	/*!
+	An n-gram and the number of long strings it is found in
+	*/
+	struct GramPostings
+	{
+		//! The characters of the gram, null terminated
+		char gram[4];
+		uint32_t postings;
+	};
+
+	/*!
+	Memory and shape statistics of an indexed library, exported through \p getIndexStats.
+	Collected when the library is built, so reading them does not walk the library.
+	*/
+	struct IndexStats
+	{
+		//! Estimated heap bytes of \p stringLib, of the posting lists, of \p wordMap, of \p wordWeight, of the LSH bands, and of the other lookup tables
+		uint64_t stringLibBytes;
+		uint64_t postingBytes;
+		uint64_t wordMapBytes;
+		uint64_t wordWeightBytes;
+		uint64_t lshBytes;
+		uint64_t otherBytes;
+		//! Estimated allocator headers and padding of all the heap blocks above
+		uint64_t allocatorOverheadBytes;
+		//! Sum of all the bytes above, as reported by \p getMemoryUsage
+		uint64_t totalBytes;
+
+		//! Number of distinct strings, and how many of them are short and long
+		uint64_t strings;
+		uint64_t shortStrings;
+		uint64_t longStrings;
+		//! Average number of master keys each string is redirected to
+		double keysPerString;
+
+		//! Number of n-grams and of their postings
+		uint64_t grams;
+		uint64_t postings;
+		//! Percentiles of the number of postings per n-gram
+		uint32_t postingsP50;
+		uint32_t postingsP99;
+		uint32_t postingsMax;
+		//! The n-grams with the most postings, heaviest first. Unused entries have 0 postings.
+		GramPostings heaviestGrams[statsTopGrams];
+
+		//! Number of copies of the posting lists, one per NUMA node if asked by \p setAllocation, and how many are backed by huge pages
+		uint32_t postingReplicas;
+		uint32_t hugePageReplicas;
+
+		//! Number of n-grams whose postings are stored as bitmaps, see \p PostingList::dense
+		uint64_t denseGrams;
+
+		//! Whether the strings are front-coded, see \p setStringPool, and the estimated bytes it saves over strings stored whole,
+		//! including their allocator overhead. 0 if not compressed.
+		bool compressedStrings;
+		uint64_t stringPoolSavedBytes;
+	};
+
+	/*!
+	Options of a search, combined as bit flags
+	*/
+	enum SearchFlags : uint32_t
+	{
+		//! Scores every string that may reach the threshold, with the cheapest strategy found by \p StringIndex::plan
+		SearchExact = 0,
+		//! Also lets the planner score only the long strings sharing an LSH band with the query. Requires \p buildLsh, otherwise ignored.
+		SearchApproximate = 1,
+		//! Searches the short and long strings on the calling thread, e.g. a worker of the executor, rather than on two new threads
+		SearchSingleThread = 2,
+		//! Returns the master keys equal to the query without the fuzzy search, if there is any
+		SearchExactFirst = 4,
+		//! Picks the strategies by the length of the query instead of their costs: the short strings are scanned for queries
+		//! shorter than 9 characters, and the long strings are scanned for queries of 3 characters or less and scored by n-grams otherwise
+		SearchFixedPlan = 8
+	};
+
+	/*!
+	How a part of the library is searched, see \p SearchPlan
+	*/
+	enum PlanStrategy : uint8_t
+	{
+		//! Not searched, as none of its strings can reach the threshold
+		PlanSkip = 0,
+		//! The edit distance of the query to the closest substring of each string long enough to reach the threshold
+		PlanScan = 1,
+		//! The n-gram hits of the strings sharing a gram with the query, see \p StringIndex::searchLong
+		PlanGrams = 2,
+		//! The n-gram hits of the strings sharing an LSH band with the query, see \p StringIndex::searchLsh
+		PlanLsh = 3
+	};
+
+	/*!
+	The plan of a search, chosen by \p StringIndex::plan and exported through \p explain.
+	Costs are estimated in nanoseconds from the statistics of the library, and are 0 for the strategies not applicable to the query.
+	*/
+	struct SearchPlan
+	{
+		//! Whether the query is a wildcard, which lists all master keys
+		bool wildcard;
+		//! Whether the query is answered by the master keys equal to it without searching, see \p SearchExactFirst
+		bool exactOnly;
+		//! How the short and the long strings are searched
+		PlanStrategy shortStrategy;
+		PlanStrategy longStrategy;
+		//! Length of the normalised query, and its number of n-grams
+		uint32_t queryLength;
+		uint32_t queryGrams;
+		//! The shortest string that can reach the threshold when scanned, and when scored by n-grams
+		uint32_t scanMinLength;
+		uint32_t gramMinLength;
+		//! Estimated number of postings of the query grams from \p gramMinLength on, and of LSH candidates. The LSH buckets are only
+		//! looked up, and their candidates and cost estimated, for a search allowed to use them, see \p SearchApproximate.
+		uint64_t postings;
+		uint64_t lshCandidates;
+		//! Estimated cost of scanning the short strings, and of each strategy for the long strings
+		double shortScanCost;
+		double longScanCost;
+		double gramCost;
+		double lshCost;
+	};
+
+	/*!
+	How \p searchLong turns the n-gram hits of a string into its score
+	*/
+	enum ScoringMode : uint8_t
+	{
+		//! Number of query grams found in the string / number of query grams
+		GramRatio = 0,
+		//! As \p GramRatio, but each gram is weighted by its inverse document frequency
+		GramIdf = 1
+	};
+
+	/*!
+	A posting list of the n-gram library
+	*/
+	struct PostingList
+	{
+		//! Where the positions of the gram start in the posting arena, see \p StringIndex::localPostings
+		uint64_t offset;
+		//! Number of positions. They are positions in \p longLib in ascending order, and thus sorted by length.
+		uint32_t count;
+		//! Inverse document frequency of the gram, computed when the library is indexed
+		float idf;
+		//! Whether the positions are stored as a bitmap over \p longLib, \p StringIndex::bitmapWords words long, rather than as a sorted array.
+		//! Grams found in more strings than the words of a bitmap are stored as bitmaps, which are then the smaller of the two.
+		bool dense;
+	};
+
+	/*!
+	The scoring state of a typeahead session, kept between keystrokes so that each one only scores the characters added.
+	Built and read by \p StringIndex::extend.
+	*/
+	struct SessionState
+	{
+		//! All text typed in the session
+		std::string text;
+
+		//! The normalised query the state has been built for
+		std::string query;
+
+		//! The generation of the library and the scoring knobs the state has been built with. The state is rebuilt if any of them changes.
+		uint64_t generation = 0;
+		uint8_t mode = 0;
+		float maxFrequency = 1.0f;
+
+		//! Number of query grams accumulated into \p gramHits
+		size_t gramCount = 0;
+
+		//! Weighted gram hits of each position in \p longLib, and the total weight of the query grams. Stop grams are excluded.
+		std::unordered_map<uint32_t, float> gramHits;
+		float totalWeight = 0;
+
+		//! As \p gramHits, for the stop grams. Only kept while the query is made of stop grams only.
+		std::unordered_map<uint32_t, float> stopHits;
+		float stopWeight = 0;
+
+		//! Number of query characters matched into \p shortRows
+		size_t shortDepth = 0;
+
+		//! The last row of the edit distance matrix of each string in \p shortLib, \p shortStride entries each
+		std::vector<uint8_t> shortRows;
+	};
+
+	/*!
+	A query normalised once, to be searched in any library with the same validChar set. Built by \p StringIndex::prepare.
+	*/
+	struct PreparedQuery
+	{
+		//! Whether the query asks for all keywords
+		bool wildcard = false;
+
+		//! The normalised query, empty if it has no valid character
+		std::string text;
+
+		//! The n-grams of \p text, empty if it is shorter than a gram
+		std::vector<int32_t> grams;
+	};
+
+	/*!
+	The query grams looked up in a library, once by \p StringIndex::plan, then scored by the strategy it picks
+	*/
+	struct GramLookup
+	{
+		//! The posting list of each query gram, or nullptr if the gram is not indexed
+		std::vector<const PostingList*> lists;
+
+		//! The weight of each query gram, 0 for the stop grams, and their total
+		std::vector<float> weights;
+		float total = 0;
+
+		//! The shortest long string that can reach the threshold, see \p StringIndex::minFeasibleLength
+		size_t minLength = 0;
+
+		//! The MinHash signature of the query grams, only computed when the LSH bands may be searched
+		std::vector<uint64_t> signature;
+	};
+
 	/*!
 	StringIndex: Each instance manages a library from the <index> function
 	@param std::string A STL string type. Can be std::string or std::wstring
@@ -116,6 +451,42 @@ namespace StringSearch
 		*/
 		StringIndex(char** const words, const size_t size, const uint16_t rowSize, float* const weight);	
 
+		/*!
+		Constructs the StringIndex class from a snapshot written by \p save.
+		The n-grams and the LSH bands are rebuilt rather than stored. If the snapshot cannot be read, the library is not indexed.
+		@param in The stream of the snapshot.
+		*/
+		StringIndex(std::istream& in);
+
+		/*!
+		Writes a snapshot of the library, to be read by the \p StringIndex(std::istream&) constructor
+		@param out The stream to write to.
+		@returns Whether the snapshot has been written
+		*/
+		bool save(std::ostream& out) const;
+
+		/*!
+		Sorts \p longLib by length, and records the offset of each length in \p longLibOffset
+		*/
+		void sortLongLib();
+
+		/*!
+		Packs the strings of \p shortLib into \p packedShort, in the same order
+		*/
+		void packShortLib();
+
+		/*!
+		Normalises the master keys as queries are normalised, and maps them in \p exactKeys. Depends on \p validChar.
+		*/
+		void buildExactKeys();
+
+		/*!
+		Normalises a master key as queries are normalised
+		@param key The position of the key in \p stringLib
+		@param normalized Output the normalised key
+		*/
+		void normalizeKey(size_t key, std::string& normalized) const;
+
 		/*!
 		Initiates the word map by assigning the same strings to a pointer, to save space.
 		@param tempWordMap A temprary word map of strings.
@@ -125,9 +496,10 @@ namespace StringSearch
 
 		/*!
 		Generate n-grams from a string based on the member variable \p gramSize.
-		@param str A pointer to the string to generate n-grams from.
+		@param pos The position of the string in \p longLib.
+		@param postings The positions of each gram, to be appended to.
 		*/
-		void getGrams(size_t id);
+		void getGrams(size_t pos, std::unordered_map<int32_t, std::vector<uint32_t>>& postings) const;
 
 		/*!
 		Generate n-grams from a string based on the member variable \p gramSize, and store in an array.
@@ -141,6 +513,186 @@ namespace StringSearch
 		*/
 		void buildGrams();
 
+		/*!
+		Copies the posting arena into \p postingReplicas, replacing the previous copies
+		@param source The positions of all posting lists
+		@param count The number of positions
+		@param mode How the copies are backed by huge pages.
+		@param perNode Whether to make one copy per NUMA node, each first touched by a thread of its node.
+		@returns Whether all copies have been allocated. The previous ones are kept otherwise.
+		*/
+		bool freezePostings(const uint32_t* source, size_t count, HugePages mode, bool perNode);
+
+		/*!
+		Get the posting arena of the NUMA node running the calling thread
+		*/
+		const uint32_t* localPostings() const
+		{
+			if (postingReplicas.size() < 2)
+				return postingReplicas.empty() ? nullptr : postingReplicas[0]->data();
+			return postingReplicas[NumaTopology::get().currentNode() % postingReplicas.size()]->data();
+		}
+
+		/*!
+		Get the number of characters of a string, without decoding it if the strings are compressed
+		@param id The position of the string in \p stringLib
+		*/
+		size_t stringLength(size_t id) const
+		{
+			return compressedStrings ? stringPool.length(id) : stringLib[id].size();
+		}
+
+		/*!
+		Get a string, decoding it if the strings are compressed
+		@param id The position of the string in \p stringLib
+		@param buffer Holds the decoded string. The string returned is only valid until the buffer is reused.
+		*/
+		const std::string& stringAt(size_t id, std::string& buffer) const
+		{
+			if (!compressedStrings)
+				return stringLib[id];
+			stringPool.decode(id, buffer);
+			return buffer;
+		}
+
+		/*!
+		Allocates the result array of a search. The results of a library whose strings are compressed are decoded into the same
+		allocation, after the pointers, so that \p release frees them alike. The others point into their library.
+		@param size The number of results
+		@param result Called with the rank of each result, returns its library and the position of its string in \p stringLib
+		*/
+		template<typename Result>
+		static char** resultArray(uint32_t size, Result result)
+		{
+			size_t decodedBytes = 0;
+			for (uint32_t i = 0; i < size; i++)
+			{
+				auto item = result(i);
+				if (item.first->compressedStrings)
+					decodedBytes += item.first->stringPool.length(item.second) + 1;
+			}
+			auto results = new char*[size + (decodedBytes + sizeof(char*) - 1) / sizeof(char*)];
+			auto decoded = reinterpret_cast<char*>(results + size);
+			std::string buffer;
+			for (uint32_t i = 0; i < size; i++)
+			{
+				auto item = result(i);
+				if (!item.first->compressedStrings)
+				{
+					results[i] = const_cast<char*>(item.first->stringLib[item.second].c_str());
+					continue;
+				}
+				item.first->stringPool.decode(item.second, buffer);
+				std::memcpy(decoded, buffer.c_str(), buffer.size() + 1);
+				results[i] = decoded;
+				decoded += buffer.size() + 1;
+			}
+			return results;
+		}
+
+		/*!
+		Get the number of 32-bit words of the bitmap of a dense posting list
+		*/
+		size_t bitmapWords() const
+		{
+			return (longLib.size() + 31) / 32;
+		}
+
+		/*!
+		Visits the positions of a posting list from \p firstPos on, in ascending order, whether it is stored as an array or as a bitmap
+		@param arena The posting arena, from \p localPostings
+		@param list The posting list
+		@param firstPos The first position visited
+		@param visit Called with each position
+		@returns The number of positions visited
+		*/
+		template<typename Visit>
+		uint32_t forEachPosting(const uint32_t* arena, const PostingList& list, uint32_t firstPos, Visit visit) const
+		{
+			auto begin = arena + list.offset;
+			if (!list.dense)
+			{
+				auto end = begin + list.count;
+				auto start = std::lower_bound(begin, end, firstPos);
+				for (auto it = start; it != end; ++it)
+					visit(*it);
+				return (uint32_t)(end - start);
+			}
+			uint32_t visited = 0;
+			for (size_t w = firstPos / 32; w < bitmapWords(); w++)
+			{
+				auto bits = begin[w];
+				if (w == firstPos / 32)
+					bits &= ~0u << (firstPos % 32);
+				for (; bits; bits &= bits - 1, visited++)
+					visit((uint32_t)(w * 32 + countTrailingZeros(bits)));
+			}
+			return visited;
+		}
+
+		/*!
+		Get the index of the lowest bit set
+		@param bits A non-zero word
+		*/
+		static uint32_t countTrailingZeros(uint32_t bits)
+		{
+#if defined(_MSC_VER)
+			unsigned long index;
+			_BitScanForward(&index, bits);
+			return index;
+#else
+			return (uint32_t)__builtin_ctz(bits);
+#endif
+		}
+
+		/*!
+		Scores the long strings from \p firstPos on against the query grams, when some of their posting lists are dense.
+		The dense lists of equal weight are counted together by a \p BitSlicedCounter, and the hits are accumulated
+		into arrays over the positions rather than into a hash map.
+		@param lists The posting list of each query gram, or nullptr if the gram is not indexed.
+		@param weights The weight of each query gram.
+		@param firstPos The first position scored.
+		@param total The total weight of the query grams.
+		@param score Targets found paired with their corresponding cores generated.
+		@returns The number of postings scored.
+		*/
+		uint64_t scoreDense(const std::vector<const PostingList*>& lists, const std::vector<float>& weights, uint32_t firstPos, float total,
+			std::unordered_map<size_t, float>& score) const;
+
+		/*!
+		Walks the library to fill \p builtStats. Called once the library is built, as it is not modified afterwards.
+		*/
+		void collectStats();
+
+		/*!
+		Estimates the heap bytes held by the LSH bands, and the number of heap blocks they take
+		@param blocks Incremented by the number of heap blocks.
+		*/
+		uint64_t lshMemory(uint64_t& blocks) const;
+
+		/*!
+		Finds the shortest string length in \p longLib that can still reach \p threshold for the query grams.
+		A string of length L holds at most L - 2 distinct grams, so it can match at most the L - 2 heaviest query grams.
+		@param generatedGrams The n-grams of the query.
+		@param weights The weight of each gram in \p generatedGrams.
+		@param threshold Lowest acceptable match ratio.
+		*/
+		size_t minFeasibleLength(const std::vector<int32_t>& generatedGrams, const std::vector<float>& weights, const float threshold) const;
+
+		/*!
+		Looks up the posting list and the scoring weight of each query gram.
+		Stop grams, i.e. grams found in more than \p maxGramFrequency of \p longLib, are given a weight of 0, unless all grams are stop grams.
+		@param generatedGrams The n-grams of the query.
+		@param lookup Output the posting lists, the weights and their total.
+		*/
+		void gramWeights(const std::vector<int32_t>& generatedGrams, GramLookup& lookup) const;
+
+		/*!
+		Counts the stop grams of a query in \p searchStats, once their postings are skipped by a search
+		@param lookup The query grams, looked up by \p gramWeights.
+		*/
+		void recordStopGrams(const GramLookup& lookup) const;
+
 		/*!
 		Hash for 3-grams
 		*/
@@ -176,28 +728,161 @@ namespace StringSearch
 
 		/*!
 		Search in the longLib
-		@param query The query string.
+		@param lookup The query grams, looked up by \p plan. Postings of strings shorter than its \p minLength are skipped.
 		@param score Targets found paired with their corresponding cores generated.
 		*/
-		void searchLong(std::string& query, std::unordered_map<size_t, float>& score) const;
+		void searchLong(const GramLookup& lookup, std::unordered_map<size_t, float>& score) const;
+
+		/*!
+		Computes the MinHash signature of a set of n-grams, \p lshBands * \p lshRows values long
+		@param grams The n-grams. Repeated grams do not change the signature.
+		*/
+		std::vector<uint64_t> minHash(const std::vector<int32_t>& grams) const;
+
+		/*!
+		Hashes the rows of a band of a MinHash signature into a bucket key
+		@param signature The MinHash signature.
+		@param band The band to be hashed.
+		*/
+		uint64_t bandKey(const std::vector<uint64_t>& signature, size_t band) const;
+
+		/*!
+		Builds the LSH bands for an approximate search over \p longLib.
+		Two strings are candidates of each other if all rows of any band of their MinHash signatures are equal.
+		More bands raise the recall, while more rows per band cut the number of candidates.
+		@param bands The number of bands. 0 to drop the LSH bands.
+		@param rows The number of MinHash values in each band.
+		*/
+		void buildLsh(uint16_t bands, uint16_t rows);
+
+		/*!
+		Approximate search in the longLib. Only strings sharing an LSH band with the query are scored, with the same metric as \p searchLong.
+		Falls back to \p searchLong if the LSH bands have not been built.
+		@param lookup The query grams and their MinHash signature, looked up by \p plan.
+		@param score Targets found paired with their corresponding cores generated.
+		*/
+		void searchLsh(const GramLookup& lookup, std::unordered_map<size_t, float>& score) const;
+
+		/*!
+		Extends the query of a typeahead session and searches for it.
+		The gram hits and the edit distance rows of the short strings are carried over from the previous keystrokes,
+		so only the new grams and the new query characters are scored.
+		@param state The session state, rebuilt if the new query does not extend the previous one.
+		@param text The characters typed.
+		@param threshold Lowest acceptable match ratio for a string to be included in the results.
+		@param limit The maximum number of results to generate.
+		*/
+		std::vector<std::pair<size_t, float>> _extend(SessionState& state, const char* text, const float threshold, const uint32_t limit) const;
+
+		/*!
+		The typeahead interface function, calls \p _extend
+		@param state The session state.
+		@param text The characters typed.
+		@param results The matching strings to be selected, sorted from highest score to lowest.
+		@param scores The scores of \p results, or nullptr if the scores are not needed.
+		@param threshold Lowest acceptable match ratio for a string to be included in the results.
+		@param limit The maximum number of results to generate.
+		*/
+		uint32_t extend(SessionState& state, const char* text, char*** results, float** scores, const float threshold, uint32_t limit) const;
 
 		/*!
 		Assigns scores to the corresponding keywords
-		@param query The query string.
 		@param entryScore The result calculated will be merged to this map based on keywords. Key: the keyword's ID, Value: the score
 		@param scoreList The score board to be processed. Key: the word's ID, Value: the score
 		@param threshold Scores lower than this threshold will be discarded
 		*/
-		void calcScore(std::string& query, std::unordered_map<size_t, float>& entryScore, std::unordered_map<size_t, float>& scoreList, const float threshold) const;
+		void calcScore(std::unordered_map<size_t, float>& entryScore, std::unordered_map<size_t, float>& scoreList, const float threshold) const;
+
+		/*!
+		Promotes the master keys equal to the query to the top score, 100
+		@param query The normalised query string.
+		@param entryScore The scores of the keywords to be seeded. Key: the keyword's ID, Value: the score
+		@returns Whether the query has exact matches
+		*/
+		bool seedExact(const std::string& query, std::unordered_map<size_t, float>& entryScore) const;
+
+		/*!
+		Finds the master keys equal to the query. The keys sharing the hash of the query are normalised again to rule out collisions.
+		@param query The normalised query string.
+		@param keys Output the master keys equal to the query, or nullptr if only whether there is one is needed
+		@returns Whether the query has exact matches
+		*/
+		bool findExact(const std::string& query, std::vector<size_t>* keys) const;
 
 		/*!
 		The worker function for search
 		@param query The query string.
 		@param threshold Lowest acceptable match ratio for a string to be included in the results.
 		@param limit The maximum number of results to generate.
+		@param flags A combination of \p SearchFlags.
 		@param result The matching strings to be selected, sorted from highest score to lowest.
 		*/
-		std::vector<std::pair<size_t, float>> _search(const char* query, const float threshold, const uint32_t limit) const;
+		std::vector<std::pair<size_t, float>> _search(const char* query, const float threshold, const uint32_t limit, const uint32_t flags = SearchExact) const;
+
+		/*!
+		Scans the long strings from a length on by edit distance, as the short strings are scanned by \p getMatchScore
+		@param query The query string.
+		@param minLength The shortest string that can reach \p threshold.
+		@param score Targets found paired with their corresponding cores generated.
+		@param threshold Lowest acceptable match ratio. Strings below it are not added to \p score.
+		*/
+		void scanLong(const std::string& query, size_t minLength, std::unordered_map<size_t, float>& score, const float threshold) const;
+
+		/*!
+		Estimates the cost of each strategy for a query from the statistics of the library, i.e. the number and lengths of the strings,
+		the lengths of the posting lists of the query grams and the sizes of the LSH buckets, and picks the cheapest for the short and the long strings.
+		@param query The query prepared by \p prepare.
+		@param threshold Lowest acceptable match ratio for a string to be included in the results.
+		@param lookup Output the query grams looked up, to be scored by the strategy picked.
+		@param flags A combination of \p SearchFlags.
+		*/
+		SearchPlan plan(const PreparedQuery& query, const float threshold, GramLookup& lookup, const uint32_t flags = SearchExact) const;
+
+		/*!
+		Get the plan \p search would follow for a query, without searching
+		@param query The query string.
+		@param threshold Lowest acceptable match ratio for a string to be included in the results.
+		@param flags A combination of \p SearchFlags.
+		*/
+		SearchPlan explain(const char* query, const float threshold, const uint32_t flags = SearchExact) const;
+
+		/*!
+		Normalises a query with the validChar set of the library, and generates its n-grams
+		@param query The query string.
+		*/
+		PreparedQuery prepare(const char* query) const;
+
+		/*!
+		Whether a query prepared by another library can be searched in this one, i.e. both have the same validChar set
+		@param other The other library.
+		*/
+		bool sameNormalization(const StringIndex& other) const;
+
+		/*!
+		The worker function for search, on a query already prepared
+		@param query The query prepared by \p prepare.
+		@param threshold Lowest acceptable match ratio for a string to be included in the results.
+		@param limit The maximum number of results to generate.
+		@param flags A combination of \p SearchFlags.
+		*/
+		std::vector<std::pair<size_t, float>> _search(const PreparedQuery& query, const float threshold, const uint32_t limit, const uint32_t flags = SearchExact) const;
+
+		/*!
+		Searches several libraries at once, and merges their results into a single list.
+		The query is prepared once per distinct validChar set, and the libraries are searched in parallel.
+		@param indexes The libraries to be searched.
+		@param weights The multiplier of the scores of each library, or nullptr to weight them equally.
+		@param count The number of libraries.
+		@param query The query string.
+		@param results The matching strings of all libraries, sorted from highest weighted score to lowest.
+		@param scores The weighted scores of \p results, or nullptr if the scores are not needed.
+		@param sources The position in \p indexes of the library of each result, or nullptr if not needed.
+		@param threshold Lowest acceptable match ratio for a string to be included in the results, before weighting.
+		@param limit The maximum number of results to generate.
+		@param flags A combination of \p SearchFlags.
+		*/
+		static uint32_t searchMulti(const StringIndex* const* indexes, const float* weights, size_t count, const char* query, char*** results,
+			float** scores, uint32_t** sources, const float threshold, uint32_t limit, const uint32_t flags = SearchExact);
 
 		/*!
 		The search interface function, calls \p _search
@@ -206,8 +891,9 @@ namespace StringSearch
 		@param size The number of strings in the result array.
 		@param threshold Lowest acceptable match ratio for a string to be included in the results.
 		@param limit The maximum number of results to generate.
+		@param flags A combination of \p SearchFlags.
 		*/
-		uint32_t search(const char* query, char*** results, const float threshold, uint32_t limit) const;
+		uint32_t search(const char* query, char*** results, const float threshold, uint32_t limit, const uint32_t flags = SearchExact) const;
 
 		/*!
 		The search interface function, calls \p _search
@@ -216,15 +902,24 @@ namespace StringSearch
 		@param size The number of strings in the result array.
 		@param threshold Lowest acceptable match ratio for a string to be included in the results.
 		@param limit The maximum number of results to generate.
+		@param flags A combination of \p SearchFlags.
 		*/
-		uint32_t score(const char* query, char*** results, float** scores, const float threshold, uint32_t limit) const;
+		uint32_t score(const char* query, char*** results, float** scores, const float threshold, uint32_t limit, const uint32_t flags = SearchExact) const;
+
+		/*!
+		Sorts the scored keys, and keeps the top \p limit ones
+		@param entryScore The scored keys. Key: the keyword's ID, Value: the score
+		@param limit The maximum number of results to generate.
+		*/
+		std::vector<std::pair<size_t, float>> rank(const std::unordered_map<size_t, float>& entryScore, const uint32_t limit) const;
 
 		/*!
 		Releases a result pointer that have been generated in \p search
 		@param results The strings allocated using the \p new operator.
 		@param scores The scores allocated using the \p new operator.
+		@param sources The sources allocated by \p searchMulti.
 		*/
-		void release(char** results, float* scores) const;
+		static void release(char** results, float* scores, uint32_t* sources = nullptr);
 
 		/*!
 		Get the size of the word map \p wordMap
@@ -236,6 +931,34 @@ namespace StringSearch
 		*/
 		uint64_t libSize() const;
 
+		/*!
+		Estimates the heap bytes held by the library, as collected by \p collectStats
+		*/
+		uint64_t memoryUsage() const;
+
+		/*!
+		Get the memory and shape statistics collected when the library was built
+		@param stats The statistics to be filled.
+		*/
+		void indexStats(IndexStats* stats) const;
+
+		/*!
+		Whether the library has been indexed and can be searched
+		*/
+		bool isIndexed() const;
+
+		/*!
+		Get the query statistics collected so far
+		@param stats The statistics to be filled.
+		*/
+		void searchStats(SearchStats* stats) const;
+
+		/*!
+		Resumes the query statistics from those of an earlier copy of the library, e.g. one evicted to the snapshot it is reloaded from
+		@param stats The statistics to resume from
+		*/
+		void resumeSearchStats(const SearchStats& stats);
+
 		/*!
 		Trim a string from both ends (in place)
 		@param s The string to be trimmed
@@ -249,9 +972,9 @@ namespace StringSearch
 		struct ScoreComparer
 		{
 		public:
-			const std::vector<std::string>& stringLib;
+			const StringIndex& instance;
 
-			ScoreComparer(const StringIndex& instance) : stringLib(instance.stringLib)
+			ScoreComparer(const StringIndex& instance) : instance(instance)
 			{ }
 
 			/*!
@@ -265,7 +988,7 @@ namespace StringSearch
 					return true;
 				if (a.second < b.second)
 					return false;
-				return stringLib[a.first].size() < stringLib[b.first].size();
+				return instance.stringLength(a.first) < instance.stringLength(b.first);
 			}
 		};
 
@@ -275,30 +998,137 @@ namespace StringSearch
 		*/
 		void setValidChar(std::unordered_set<char>& newValidChar);
 
+		/*!
+		Adjusts the quality/latency trade-off of the n-gram search. Not thread safe: no search may run meanwhile.
+		@param mode How the n-gram hits are scored.
+		@param maxFrequency Grams found in more than this fraction of the long strings are ignored as stop grams. 1 to keep all grams.
+		*/
+		void setScoring(ScoringMode mode, float maxFrequency);
+
+		/*!
+		Moves the posting lists to memory backed by huge pages, and/or replicated on each NUMA node so that searches read the
+		copy local to their thread. Not thread safe: no search may run meanwhile.
+		@param mode How the posting lists are backed by huge pages.
+		@param perNode Whether to keep one copy of the posting lists per NUMA node.
+		@returns Whether the posting lists have been moved. They are left as they were otherwise.
+		*/
+		bool setAllocation(HugePages mode, bool perNode);
+
+		/*!
+		Front-codes the strings into \p stringPool, or decodes them back into \p stringLib. While compressed, a string is decoded
+		only to be compared to the query by a scan, or to be returned as a result. The ids of the strings are left as they are.
+		Not thread safe: no search may run meanwhile, and no result array may point into \p stringLib.
+		@param compressed Whether to compress the strings.
+		*/
+		void setStringPool(bool compressed);
+
 	private:
+		//! All strings, sorted. Empty while they are compressed into \p stringPool.
 		std::vector<std::string> stringLib;
 
-		//! The library for all words that have a length >= \p gramSize * 2
+		//! The strings of \p stringLib front-coded, with the same positions, see \p setStringPool
+		FrontCodedPool stringPool;
+		bool compressedStrings = false;
+
+		//! The library for all words that have a length >= \p gramSize * 2, sorted by length
 		std::vector<size_t> longLib;
 
+		//! The position of the first string in \p longLib of each length, indexed by length
+		std::vector<uint32_t> longLibOffset;
+
+		//! The number of characters of the strings in \p longLib from each length on, indexed by length
+		std::vector<uint64_t> longLibChars;
+
 		std::unordered_map<std::string, size_t> longMap;
 
 		//! The library for all words that have a length < \p gramSize * 2
 		std::vector<size_t> shortLib;
 
+		//! The strings of \p shortLib packed for the SIMD kernels of \p getMatchScore
+		PackedStrings packedShort;
+
+		//! The longest string of \p shortLib
+		size_t shortLongest = 0;
+
+		//! Entries of an edit distance row of a string in \p shortLib
+		static const size_t shortStride = 6;
+
+		//! Format version of the snapshots written by \p save
+		static constexpr uint32_t snapshotVersion = 2;
+
+		//! Estimated allocator header and alignment padding of a heap block, see \p collectStats
+		static constexpr uint64_t blockOverhead = 16;
+
+		//! Estimated costs of the steps of a search in nanoseconds, see \p plan: an edit distance cell and a string scanned,
+		//! a query character over a block of \p packedShort, a string scored, a query gram looked up, a sparse posting accumulated,
+		//! a bitmap word of a dense posting list counted, a MinHash value of a query gram, a query gram of an LSH candidate checked,
+		//! and a thread started for the short strings
+		static constexpr double costCell = 2.5;
+		static constexpr double costScanString = 150;
+		static constexpr double costPackedBlock = 4;
+		static constexpr double costString = 80;
+		static constexpr double costLookup = 40;
+		static constexpr double costPosting = 12;
+		static constexpr double costBitmapWord = 1;
+		static constexpr double costHash = 2;
+		static constexpr double costCandidateGram = 8;
+		static constexpr double costThread = 30000;
+
 		//! All words, mapped to their master keys. A search result will always be redirected to its master keys
 		std::unordered_map<size_t, std::vector<size_t>> wordMap;
 
+		//! The master keys, by the hash of their normalised string, so that no copy of the keys is kept. A query equal to a normalised key is an exact match.
+		std::unordered_map<size_t, std::vector<size_t>> exactKeys;
+
 		//! Weights to keys
 		std::unordered_map<size_t, std::unordered_map<size_t, float>> wordWeight;
 
 		//! The n-gram library generated
-		std::unordered_map<int32_t, std::unordered_set<size_t>> ngrams;
+		std::unordered_map<int32_t, PostingList> ngrams;
+
+		//! The positions of all posting lists, one list after another. One copy per NUMA node if asked by \p setAllocation.
+		std::vector<std::unique_ptr<FrozenArray<uint32_t>>> postingReplicas;
+		HugePages postingPages = HugePagesOff;
+
+		//! Size of the LSH bands, see \p buildLsh
+		uint16_t lshBands = 0;
+		uint16_t lshRows = 0;
+
+		//! For each LSH band, the positions in \p longLib of the strings in each bucket
+		std::vector<std::unordered_map<uint64_t, std::vector<uint32_t>>> lshBuckets;
 
 		size_t longest = 0;
 
 		//! Indicator of whether the library has been indexed. If not indexed, no search can be done.
-		std::atomic<bool> indexed;
+		std::atomic<bool> indexed{ false };
+
+		//! Statistics behind \p indexStats and \p memoryUsage
+		IndexStats builtStats = IndexStats();
+
+		//! Counters behind \p searchStats
+		mutable std::atomic<uint64_t> queryCount{ 0 };
+		mutable std::atomic<uint64_t> postingsVisited{ 0 };
+		mutable std::atomic<uint64_t> postingsSkipped{ 0 };
+		mutable std::atomic<uint64_t> stopGramsSkipped{ 0 };
+		mutable std::atomic<uint64_t> stopPostingsSkipped{ 0 };
+		mutable std::atomic<uint64_t> lshCandidates{ 0 };
+
+		/*!
+		Get a generation no library has had before, starting from 1
+		*/
+		static uint64_t newGeneration()
+		{
+			static std::atomic<uint64_t> last{ 0 };
+			return ++last;
+		}
+
+		//! Identifies the library and its valid characters to the typeahead sessions, see \p SessionState. Unlike its address,
+		//! it is not reused by a library built after this one is disposed, and it changes with \p setValidChar.
+		uint64_t generation = newGeneration();
+
+		//! Scoring knobs, see \p setScoring
+		std::atomic<uint8_t> scoringMode{ GramRatio };
+		std::atomic<float> maxGramFrequency{ 1.0f };
 
 		//! deprecated
 		const float distanceFactor = 0.2f;
@@ -8,15 +8,19 @@
 
 /*!
 Generate n-grams from a string based on the member variable \p gramSize.
-@param str A pointer to the string to generate n-grams from.
+@param pos The position of the string in \p longLib.
+@param postings The positions of each gram, to be appended to.
 */
-void StringSearch::StringIndex::getGrams(size_t id)
+void StringSearch::StringIndex::getGrams(size_t pos, std::unordered_map<int32_t, std::vector<uint32_t>>& postings) const
 {
-	auto& str = stringLib[id];
+	std::string buffer;
+	auto& str = stringAt(longLib[pos], buffer);
 	for (size_t i = 0; i < str.size() - 2; i++)
 	{
-		auto hash = gramHash(str, i);
-		ngrams[hash].insert(id);
+		auto& positions = postings[gramHash(str, i)];
+		//positions are visited in ascending order, so a repeated gram can only duplicate the last posting
+		if (positions.empty() || positions.back() != pos)
+			positions.push_back((uint32_t)pos);
 	}
 }
 
@@ -40,11 +44,188 @@ Build n-grams for the member variable \p longLib
 */
 void StringSearch::StringIndex::buildGrams()
 {
-	for (auto& id : longLib)
-		getGrams(id);
+	std::unordered_map<int32_t, std::vector<uint32_t>> postings;
+	for (size_t pos = 0; pos < longLib.size(); pos++)
+		getGrams(pos, postings);
+	//the lists are laid out one after another in a single arena, which is frozen from now on
+	//grams found in more strings than the words of a bitmap are stored as bitmaps, the others as sorted arrays
+	std::vector<uint32_t> arena;
+	auto words = bitmapWords();
+	size_t total = 0;
+	for (auto& kp : postings)
+		total += std::min(kp.second.size(), words);
+	arena.reserve(total);
+	ngrams.reserve(postings.size());
+	for (auto& kp : postings)
+	{
+		auto& list = ngrams[kp.first];
+		list.offset = arena.size();
+		list.count = (uint32_t)kp.second.size();
+		list.dense = kp.second.size() > words;
+		//document frequency statistics: rare grams carry more weight in the GramIdf scoring mode
+		list.idf = std::log(1.0f + (float)longLib.size() / list.count);
+		if (list.dense)
+		{
+			arena.resize(arena.size() + words, 0);
+			auto bitmap = &arena[list.offset];
+			for (auto pos : kp.second)
+				bitmap[pos / 32] |= 1u << (pos % 32);
+		}
+		else
+			arena.insert(arena.end(), kp.second.begin(), kp.second.end());
+		std::vector<uint32_t>().swap(kp.second);
+	}
+	if (!freezePostings(arena.data(), arena.size(), postingPages, postingReplicas.size() > 1))
+	{
+		//no memory could be mapped for the copies, so the lists stay in the arena they have been built in
+		std::vector<std::unique_ptr<FrozenArray<uint32_t>>> heap;
+		heap.push_back(std::make_unique<FrozenArray<uint32_t>>(std::move(arena)));
+		postingReplicas.swap(heap);
+		postingPages = HugePagesOff;
+	}
+	collectStats();
 	indexed = true;
 }
 
+/*!
+Copies the posting arena into \p postingReplicas, replacing the previous copies
+@param source The positions of all posting lists
+@param count The number of positions
+@param mode How the copies are backed by huge pages.
+@param perNode Whether to make one copy per NUMA node, each first touched by a thread of its node.
+@returns Whether all copies have been allocated. The previous ones are kept otherwise.
+*/
+bool StringSearch::StringIndex::freezePostings(const uint32_t* source, size_t count, HugePages mode, bool perNode)
+{
+	auto& topology = NumaTopology::get();
+	std::vector<std::unique_ptr<FrozenArray<uint32_t>>> replicas(perNode ? topology.nodes() : 1);
+	if (replicas.size() == 1)
+		replicas[0] = std::make_unique<FrozenArray<uint32_t>>(source, count, mode);
+	else
+	{
+		std::vector<std::thread> copiers;
+		for (size_t node = 0; node < replicas.size(); node++)
+			copiers.emplace_back([&, node]() {
+				topology.pin(node);
+				replicas[node] = std::make_unique<FrozenArray<uint32_t>>(source, count, mode);
+			});
+		for (auto& copier : copiers)
+			copier.join();
+	}
+	for (auto& replica : replicas)
+		if (replica->size() != count)
+			return false;
+	postingReplicas.swap(replicas);
+	postingPages = mode;
+	return true;
+}
+
+/*!
+Moves the posting lists to memory backed by huge pages, and/or replicated on each NUMA node so that searches read the
+copy local to their thread. Not thread safe: no search may run meanwhile.
+@param mode How the posting lists are backed by huge pages.
+@param perNode Whether to keep one copy of the posting lists per NUMA node.
+@returns Whether the posting lists have been moved. They are left as they were otherwise.
+*/
+bool StringSearch::StringIndex::setAllocation(HugePages mode, bool perNode)
+{
+	if (!indexed || postingReplicas.empty())
+		return false;
+	if (mode == postingPages && perNode == (postingReplicas.size() > 1))
+		return true;
+	auto& current = *postingReplicas[0];
+	if (!freezePostings(current.data(), current.size(), mode, perNode))
+		return false;
+	collectStats();
+	return true;
+}
+
+/*!
+Finds the shortest string length in \p longLib that can still reach \p threshold for the query grams.
+A string of length L holds at most L - 2 distinct grams, so it can match at most the L - 2 heaviest query grams.
+@param generatedGrams The n-grams of the query.
+@param weights The weight of each gram in \p generatedGrams.
+@param threshold Lowest acceptable match ratio.
+*/
+size_t StringSearch::StringIndex::minFeasibleLength(const std::vector<int32_t>& generatedGrams, const std::vector<float>& weights,
+	const float threshold) const
+{
+	std::unordered_map<int32_t, float> gramWeight;
+	float total = 0;
+	for (size_t i = 0; i < generatedGrams.size(); i++)
+	{
+		gramWeight[generatedGrams[i]] += weights[i];
+		total += weights[i];
+	}
+	std::vector<float> heaviest;
+	heaviest.reserve(gramWeight.size());
+	for (auto& kp : gramWeight)
+		heaviest.push_back(kp.second);
+	std::sort(heaviest.begin(), heaviest.end(), std::greater<float>());
+
+	float maxHits = 0;
+	for (size_t i = 0; i < heaviest.size(); i++)
+	{
+		maxHits += heaviest[i];
+		if (maxHits / total >= threshold)
+			return i + 3;
+	}
+	return heaviest.size() + 2;
+}
+
+/*!
+Looks up the posting list and the scoring weight of each query gram.
+Stop grams, i.e. grams found in more than \p maxGramFrequency of \p longLib, are given a weight of 0, unless all grams are stop grams.
+@param generatedGrams The n-grams of the query.
+@param lookup Output the posting lists, the weights and their total.
+*/
+void StringSearch::StringIndex::gramWeights(const std::vector<int32_t>& generatedGrams, GramLookup& lookup) const
+{
+	bool idf = scoringMode == GramIdf;
+	//a gram missing from the library is rarer than any indexed gram
+	float missingIdf = std::log(1.0f + (float)longLib.size());
+	float maxPostings = maxGramFrequency * longLib.size();
+
+	auto& lists = lookup.lists;
+	auto& weights = lookup.weights;
+	lists.assign(generatedGrams.size(), nullptr);
+	weights.assign(generatedGrams.size(), 1.0f);
+	size_t stopGrams = 0;
+	for (size_t i = 0; i < generatedGrams.size(); i++)
+	{
+		auto found = ngrams.find(generatedGrams[i]);
+		if (found != ngrams.end())
+			lists[i] = &found->second;
+		if (idf)
+			weights[i] = lists[i] ? lists[i]->idf : missingIdf;
+		if (lists[i] && lists[i]->count > maxPostings)
+			stopGrams++;
+	}
+	//a query made of stop grams only is still scored on them
+	if (stopGrams != 0 && stopGrams != generatedGrams.size())
+		for (size_t i = 0; i < generatedGrams.size(); i++)
+			if (lists[i] && lists[i]->count > maxPostings)
+				weights[i] = 0;
+	lookup.total = 0;
+	for (auto weight : weights)
+		lookup.total += weight;
+}
+
+/*!
+Counts the stop grams of a query in \p searchStats, once their postings are skipped by a search
+@param lookup The query grams, looked up by \p gramWeights.
+*/
+void StringSearch::StringIndex::recordStopGrams(const GramLookup& lookup) const
+{
+	//the weights are positive in both scoring modes, but for the stop grams
+	for (size_t i = 0; i < lookup.lists.size(); i++)
+		if (lookup.lists[i] && lookup.weights[i] == 0)
+		{
+			stopGramsSkipped++;
+			stopPostingsSkipped += lookup.lists[i]->count;
+		}
+}
+
 
 /*!
 Initiates the word map by assigning the same strings to a pointer, to save space.
@@ -102,11 +283,99 @@ void StringSearch::StringIndex::init(std::unordered_map<std::string, std::vector
 		}
 	}
 
+	sortLongLib();
+	packShortLib();
+	buildExactKeys();
+
 	stringLib.shrink_to_fit();
 	longLib.shrink_to_fit();
 	shortLib.shrink_to_fit();
 }
 
+/*!
+Sorts \p longLib by length, and records the offset of each length in \p longLibOffset
+*/
+void StringSearch::StringIndex::sortLongLib()
+{
+	//sort longLib by length so that n-gram postings can be pruned by length
+	std::sort(longLib.begin(), longLib.end(), [this](size_t a, size_t b) {
+		if (stringLength(a) != stringLength(b))
+			return stringLength(a) < stringLength(b);
+		return a < b;
+	});
+	longLibOffset.assign(longest + 2, 0);
+	size_t pos = 0;
+	for (size_t len = 0; len < longLibOffset.size(); len++)
+	{
+		while (pos < longLib.size() && stringLength(longLib[pos]) < len)
+			pos++;
+		longLibOffset[len] = (uint32_t)pos;
+	}
+	//the characters a scan of the long strings from each length on goes through, for the planner
+	longLibChars.assign(longLibOffset.size() + 1, 0);
+	for (size_t len = longLibOffset.size(); len-- > 0;)
+	{
+		auto end = len + 1 < longLibOffset.size() ? longLibOffset[len + 1] : (uint32_t)longLib.size();
+		longLibChars[len] = longLibChars[len + 1] + (uint64_t)(end - longLibOffset[len]) * len;
+	}
+}
+
+/*!
+Packs the strings of \p shortLib into \p packedShort, in the same order
+*/
+void StringSearch::StringIndex::packShortLib()
+{
+	//only compressed strings are decoded, the others are packed from stringLib
+	std::vector<std::string> decoded(compressedStrings ? shortLib.size() : 0);
+	std::vector<const std::string*> strings;
+	strings.reserve(shortLib.size());
+	shortLongest = 0;
+	for (size_t i = 0; i < shortLib.size(); i++)
+	{
+		auto str = compressedStrings ? &stringAt(shortLib[i], decoded[i]) : &stringLib[shortLib[i]];
+		strings.push_back(str);
+		shortLongest = std::max(shortLongest, str->size());
+	}
+	packedShort.pack(strings);
+}
+
+/*!
+Normalises the master keys as queries are normalised, and maps them in \p exactKeys. Depends on \p validChar.
+*/
+void StringSearch::StringIndex::buildExactKeys()
+{
+	//only keys reachable with a weight can be returned
+	std::unordered_set<size_t> keys;
+	for (auto& kp : wordWeight)
+		for (auto& weightPair : kp.second)
+			keys.insert(weightPair.first);
+	exactKeys.clear();
+	exactKeys.reserve(keys.size());
+	std::string normalized;
+	for (auto key : keys)
+	{
+		normalizeKey(key, normalized);
+		if (normalized.size() != 0)
+			exactKeys[std::hash<std::string>()(normalized)].push_back(key);
+	}
+	for (auto& kp : exactKeys)
+		std::sort(kp.second.begin(), kp.second.end());
+}
+
+/*!
+Normalises a master key as queries are normalised
+@param key The position of the key in \p stringLib
+@param normalized Output the normalised key
+*/
+void StringSearch::StringIndex::normalizeKey(size_t key, std::string& normalized) const
+{
+	std::string buffer;
+	normalized = stringAt(key, buffer);
+	escapeBlank(normalized, validChar);
+	trim(normalized);
+	toUpper(normalized);
+}
+
 /*!
 Constructs the StringIndex class by indexing the strings based on an array of words
 @param words Words to be searched for. For each row, the first word is used as the master key, in which the row size is \p rowSize.
@@ -172,6 +441,139 @@ StringSearch::StringIndex::StringIndex(char** const words, const size_t size, co
 }
 
 
+/*!
+Constructs the StringIndex class from a snapshot written by \p save.
+The n-grams and the LSH bands are rebuilt rather than stored. If the snapshot cannot be read, the library is not indexed.
+@param in The stream of the snapshot.
+*/
+StringSearch::StringIndex::StringIndex(std::istream& in)
+{
+	uint32_t version = 0;
+	readValue(in, version);
+	if (!in || version != snapshotVersion)
+		return;
+
+	std::vector<char> chars;
+	readVector(in, chars);
+	validChar = std::unordered_set<char>(chars.begin(), chars.end());
+	uint8_t mode = GramRatio;
+	float maxFrequency = 1.0f;
+	readValue(in, mode);
+	readValue(in, maxFrequency);
+	setScoring(mode == GramIdf ? GramIdf : GramRatio, maxFrequency);
+	uint16_t bands = 0, rows = 0;
+	readValue(in, bands);
+	readValue(in, rows);
+	bool compressed = false;
+	readValue(in, compressed);
+
+	uint64_t count = 0;
+	readValue(in, count);
+	for (uint64_t i = 0; i < count && in; i++)
+	{
+		std::vector<char> str;
+		readVector(in, str);
+		stringLib.emplace_back(str.begin(), str.end());
+		longest = std::max(longest, stringLib.back().size());
+	}
+	readVector(in, longLib);
+	readVector(in, shortLib);
+
+	readValue(in, count);
+	for (uint64_t i = 0; i < count && in; i++)
+	{
+		uint64_t id = 0;
+		readValue(in, id);
+		readVector(in, wordMap[(size_t)id]);
+	}
+	readValue(in, count);
+	for (uint64_t i = 0; i < count && in; i++)
+	{
+		uint64_t id = 0;
+		std::vector<std::pair<size_t, float>> weights;
+		readValue(in, id);
+		readVector(in, weights);
+		wordWeight[(size_t)id] = std::unordered_map<size_t, float>(weights.begin(), weights.end());
+	}
+	if (!in)
+		return;
+	for (auto id : longLib)
+		if (id >= stringLib.size())
+			return;
+
+	for (auto id : shortLib)
+		if (id >= stringLib.size() || stringLib[id].size() > PackedStrings::width)
+			return;
+
+	for (auto& kp : wordMap)
+	{
+		if (kp.first >= stringLib.size())
+			return;
+		for (auto id : kp.second)
+			if (id >= stringLib.size())
+				return;
+	}
+	for (auto& kp : wordWeight)
+	{
+		if (kp.first >= stringLib.size())
+			return;
+		for (auto& weight : kp.second)
+			if (weight.first >= stringLib.size())
+				return;
+	}
+
+	sortLongLib();
+	packShortLib();
+	buildExactKeys();
+	buildGrams();
+	buildLsh(bands, rows);
+	if (compressed)
+		setStringPool(true);
+}
+
+/*!
+Writes a snapshot of the library, to be read by the \p StringIndex(std::istream&) constructor
+@param out The stream to write to.
+@returns Whether the snapshot has been written
+*/
+bool StringSearch::StringIndex::save(std::ostream& out) const
+{
+	writeValue(out, snapshotVersion);
+	writeVector(out, std::vector<char>(validChar.begin(), validChar.end()));
+	writeValue(out, scoringMode.load());
+	writeValue(out, maxGramFrequency.load());
+	writeValue(out, lshBands);
+	writeValue(out, lshRows);
+	writeValue(out, compressedStrings);
+
+	//the strings are written whole, and compressed again when read
+	auto count = compressedStrings ? stringPool.size() : stringLib.size();
+	writeValue(out, (uint64_t)count);
+	std::string buffer;
+	for (size_t i = 0; i < count; i++)
+	{
+		auto& str = stringAt(i, buffer);
+		writeVector(out, std::vector<char>(str.begin(), str.end()));
+	}
+	writeVector(out, longLib);
+	writeVector(out, shortLib);
+
+	writeValue(out, (uint64_t)wordMap.size());
+	for (auto& kp : wordMap)
+	{
+		writeValue(out, (uint64_t)kp.first);
+		writeVector(out, kp.second);
+	}
+	writeValue(out, (uint64_t)wordWeight.size());
+	for (auto& kp : wordWeight)
+	{
+		writeValue(out, (uint64_t)kp.first);
+		writeVector(out, std::vector<std::pair<size_t, float>>(kp.second.begin(), kp.second.end()));
+	}
+	out.flush();
+	return (bool)out;
+}
+
 /*!
 Computes the percentage of \p query matches \p source.
 @param query A query string
@@ -232,25 +634,50 @@ A looper to calculate match scores
 void StringSearch::StringIndex::getMatchScore(const std::string& query, std::unordered_map<size_t, float>& score) const
 {
 	auto size = std::max(query.size() + 1, (size_t)6);
-	if (query.size() <= 3)
-		size = longest + 1;
 	//allocate levenstein temporary containers
 	std::vector<size_t> row1(size);
 	std::vector<size_t> row2(size);
-	for (size_t i = 0; i < shortLib.size(); i++)
+	if (query.size() <= PackedStrings::maxQuery)
 	{
-		auto& source = shortLib[i];
-		auto match = stringMatch(query, stringLib[source], row1, row2);
-		score[source] += (float)match / query.size();
+		//a sweep of the packed strings, many at a time
+		std::vector<uint8_t> misMatch((shortLib.size() + PackedStrings::lanes - 1) / PackedStrings::lanes * PackedStrings::lanes);
+		packedShort.match(query, misMatch.data());
+		for (size_t i = 0; i < shortLib.size(); i++)
+			score[shortLib[i]] += (float)(query.size() - misMatch[i]) / query.size();
 	}
-	//search for all strings if n-gram does not work
-	if (query.size() <= 3)
-		for (size_t i = 0; i < longLib.size(); i++)
+	else
+	{
+		std::string buffer;
+		for (size_t i = 0; i < shortLib.size(); i++)
 		{
-			auto& source = longLib[i];
-			auto match = stringMatch(query, stringLib[source], row1, row2);
+			auto& source = shortLib[i];
+			auto match = stringMatch(query, stringAt(source, buffer), row1, row2);
 			score[source] += (float)match / query.size();
 		}
+	}
+}
+
+/*!
+Scans the long strings from a length on by edit distance, as the short strings are scanned by \p getMatchScore
+@param query The query string.
+@param minLength The shortest string that can reach \p threshold.
+@param score Targets found paired with their corresponding cores generated.
+@param threshold Lowest acceptable match ratio. Strings below it are not added to \p score.
+*/
+void StringSearch::StringIndex::scanLong(const std::string& query, size_t minLength, std::unordered_map<size_t, float>& score,
+	const float threshold) const
+{
+	std::vector<size_t> row1(longest + 1);
+	std::vector<size_t> row2(longest + 1);
+	size_t firstPos = minLength < longLibOffset.size() ? longLibOffset[minLength] : longLib.size();
+	std::string buffer;
+	for (size_t i = firstPos; i < longLib.size(); i++)
+	{
+		auto& source = longLib[i];
+		auto ratio = (float)stringMatch(query, stringAt(source, buffer), row1, row2) / query.size();
+		if (ratio >= threshold)
+			score[source] += ratio;
+	}
 }
 
 
@@ -261,53 +688,282 @@ Search in the shortLib
 */
 void StringSearch::StringIndex::searchShort(std::string& query, std::unordered_map<size_t, float>& score) const
 {
-	auto len = query.size();
-	auto dicSize = shortLib.size();
-	if (query.size() <= 3)
-		dicSize += longLib.size();
-
 	getMatchScore(query, score);
 }
 
 
 /*!
 Search in the longLib
-@param query The query string.
+@param lookup The query grams, looked up by \p plan. Postings of strings shorter than its \p minLength are skipped.
 @param score Targets found paired with their corresponding cores generated.
 */
-void StringSearch::StringIndex::searchLong(std::string& query, std::unordered_map<size_t, float>& score) const
+void StringSearch::StringIndex::searchLong(const GramLookup& lookup, std::unordered_map<size_t, float>& score) const
 {
-	auto len = query.size();
-	if (len < (size_t)3)
+	if (lookup.lists.empty())
 		return;
+	auto& lists = lookup.lists;
+	auto& weights = lookup.weights;
+	auto total = lookup.total;
 
-	auto generatedGrams = getGrams(query);
-	if (generatedGrams.empty())
+	//strings shorter than minLength cannot reach the threshold, and they lie before firstPos in every posting list
+	auto minLen = lookup.minLength;
+	uint32_t firstPos = minLen < longLibOffset.size() ? longLibOffset[minLen] : (uint32_t)longLib.size();
+
+	uint64_t postings = 0;
+	bool dense = false;
+	for (size_t i = 0; i < lists.size(); i++)
+		if (lists[i] && weights[i] != 0)
+		{
+			postings += lists[i]->count;
+			dense = dense || lists[i]->dense;
+		}
+	if (dense)
+	{
+		auto visited = scoreDense(lists, weights, firstPos, total, score);
+		postingsVisited += visited;
+		postingsSkipped += postings - visited;
 		return;
-	std::unordered_map<size_t, size_t> rawScore(longLib.size());
+	}
+
+	std::unordered_map<uint32_t, float> rawScore(longLib.size());
+	uint64_t visited = 0;
+	auto arena = localPostings();
 	//may consider parallelsm here in the future
-	for (auto& gram : generatedGrams)
+	for (size_t i = 0; i < lists.size(); i++)
 	{
-		auto found = ngrams.find(gram);
-		if (found != ngrams.end())
+		if (!lists[i] || weights[i] == 0)
+			continue;
+		auto weight = weights[i];
+		visited += forEachPosting(arena, *lists[i], firstPos, [&](uint32_t pos) { rawScore[pos] += weight; });
+	}
+	postingsVisited += visited;
+	postingsSkipped += postings - visited;
+	for (auto& kp : rawScore)
+		score[longLib[kp.first]] = kp.second / total;
+}
+
+/*!
+Scores the long strings from \p firstPos on against the query grams, when some of their posting lists are dense.
+The dense lists of equal weight are counted together by a \p BitSlicedCounter, and the hits are accumulated
+into arrays over the positions rather than into a hash map.
+@param lists The posting list of each query gram, or nullptr if the gram is not indexed.
+@param weights The weight of each query gram.
+@param firstPos The first position scored.
+@param total The total weight of the query grams.
+@param score Targets found paired with their corresponding cores generated.
+@returns The number of postings scored.
+*/
+uint64_t StringSearch::StringIndex::scoreDense(const std::vector<const PostingList*>& lists, const std::vector<float>& weights, uint32_t firstPos,
+	float total, std::unordered_map<size_t, float>& score) const
+{
+	auto arena = localPostings();
+	//positions are counted from the start of the word of firstPos, and marked in hit once scored
+	size_t firstWord = firstPos / 32;
+	size_t words = bitmapWords() - firstWord;
+	uint32_t base = (uint32_t)(firstWord * 32);
+	std::vector<float> rawScore(words * 32, 0.0f);
+	std::vector<uint32_t> hit(words, 0);
+	uint64_t visited = 0;
+
+	std::vector<std::pair<float, const uint32_t*>> bitmaps;
+	for (size_t i = 0; i < lists.size(); i++)
+	{
+		if (!lists[i] || weights[i] == 0)
+			continue;
+		if (lists[i]->dense)
+			bitmaps.emplace_back(weights[i], arena + lists[i]->offset);
+		else
 		{
-			auto& sourceSet = found->second;
-			for (size_t match : sourceSet)
-				rawScore[match]++;
+			auto weight = weights[i];
+			visited += forEachPosting(arena, *lists[i], firstPos, [&](uint32_t pos) {
+				rawScore[pos - base] += weight;
+				hit[(pos - base) / 32] |= 1u << (pos % 32);
+			});
 		}
 	}
-	for (auto& kp : rawScore)
-		score[kp.first] = (float)kp.second / generatedGrams.size();
+
+	//the counts are sliced a block of words at a time, so that the slices stay in the cache
+	const size_t blockWords = 256;
+	std::sort(bitmaps.begin(), bitmaps.end(), [](const std::pair<float, const uint32_t*>& a, const std::pair<float, const uint32_t*>& b) {
+		return a.first < b.first;
+	});
+	std::vector<const uint32_t*> group;
+	std::vector<uint32_t> sliced(BitSlicedCounter::slices * blockWords);
+	uint32_t firstMask = ~0u << (firstPos % 32);
+	for (size_t g = 0; g < bitmaps.size();)
+	{
+		auto weight = bitmaps[g].first;
+		group.clear();
+		for (; g < bitmaps.size() && bitmaps[g].first == weight && group.size() < BitSlicedCounter::maxBitmaps; g++)
+			group.push_back(bitmaps[g].second);
+		auto bits = BitSlicedCounter::width(group.size());
+		for (size_t block = 0; block < words; block += blockWords)
+		{
+			auto blockSize = std::min(blockWords, words - block);
+			BitSlicedCounter::count(group.data(), group.size(), firstWord + block, blockSize, sliced.data());
+			for (size_t w = 0; w < blockSize; w++)
+			{
+				uint32_t any = 0;
+				for (size_t k = 0; k < bits; k++)
+					any |= sliced[k * blockSize + w];
+				if (block + w == 0)
+					any &= firstMask;
+				if (!any)
+					continue;
+				hit[block + w] |= any;
+				for (; any; any &= any - 1)
+				{
+					auto bit = countTrailingZeros(any);
+					uint32_t hits = 0;
+					for (size_t k = 0; k < bits; k++)
+						hits |= ((sliced[k * blockSize + w] >> bit) & 1u) << k;
+					rawScore[(block + w) * 32 + bit] += hits * weight;
+					visited += hits;
+				}
+			}
+		}
+	}
+
+	for (size_t w = 0; w < words; w++)
+		for (auto bits = hit[w]; bits; bits &= bits - 1)
+		{
+			auto offset = w * 32 + countTrailingZeros(bits);
+			score[longLib[base + offset]] = rawScore[offset] / total;
+		}
+	return visited;
+}
+
+/*!
+Computes the MinHash signature of a set of n-grams, \p lshBands * \p lshRows values long
+@param grams The n-grams. Repeated grams do not change the signature.
+*/
+std::vector<uint64_t> StringSearch::StringIndex::minHash(const std::vector<int32_t>& grams) const
+{
+	std::vector<uint64_t> signature((size_t)lshBands * lshRows, (std::numeric_limits<uint64_t>::max)());
+	for (auto gram : grams)
+	{
+		//the i-th hash function is seeded by i
+		auto gramKey = mix64((uint32_t)gram);
+		for (size_t i = 0; i < signature.size(); i++)
+		{
+			auto hash = mix64(gramKey + i);
+			if (hash < signature[i])
+				signature[i] = hash;
+		}
+	}
+	return signature;
+}
+
+/*!
+Hashes the rows of a band of a MinHash signature into a bucket key
+@param signature The MinHash signature.
+@param band The band to be hashed.
+*/
+uint64_t StringSearch::StringIndex::bandKey(const std::vector<uint64_t>& signature, size_t band) const
+{
+	uint64_t key = 0;
+	for (size_t i = band * lshRows; i < (band + 1) * lshRows; i++)
+		key = mix64(key ^ signature[i]);
+	return key;
+}
+
+/*!
+Builds the LSH bands for an approximate search over \p longLib.
+Two strings are candidates of each other if all rows of any band of their MinHash signatures are equal.
+More bands raise the recall, while more rows per band cut the number of candidates.
+@param bands The number of bands. 0 to drop the LSH bands.
+@param rows The number of MinHash values in each band.
+*/
+void StringSearch::StringIndex::buildLsh(uint16_t bands, uint16_t rows)
+{
+	lshBands = rows ? bands : 0;
+	lshRows = bands ? rows : 0;
+	uint64_t oldBlocks = 0, newBlocks = 0;
+	auto oldBytes = lshMemory(oldBlocks);
+	lshBuckets.assign(lshBands, std::unordered_map<uint64_t, std::vector<uint32_t>>());
+	std::string buffer;
+	for (size_t pos = 0; lshBands && pos < longLib.size(); pos++)
+	{
+		auto signature = minHash(getGrams(stringAt(longLib[pos], buffer)));
+		for (size_t band = 0; band < lshBands; band++)
+			lshBuckets[band][bandKey(signature, band)].push_back((uint32_t)pos);
+	}
+	//only the LSH share of the statistics changes
+	auto newBytes = lshMemory(newBlocks);
+	builtStats.lshBytes = newBytes;
+	builtStats.allocatorOverheadBytes = builtStats.allocatorOverheadBytes + (newBlocks - oldBlocks) * blockOverhead;
+	builtStats.totalBytes = builtStats.totalBytes + newBytes - oldBytes + (newBlocks - oldBlocks) * blockOverhead;
+}
+
+/*!
+Approximate search in the longLib. Only strings sharing an LSH band with the query are scored, with the same metric as \p searchLong.
+Falls back to \p searchLong if the LSH bands have not been built, or the signature of the query not computed.
+@param lookup The query grams and their MinHash signature, looked up by \p plan.
+@param score Targets found paired with their corresponding cores generated.
+*/
+void StringSearch::StringIndex::searchLsh(const GramLookup& lookup, std::unordered_map<size_t, float>& score) const
+{
+	if (lshBuckets.empty() || lookup.signature.empty())
+	{
+		searchLong(lookup, score);
+		return;
+	}
+	auto& lists = lookup.lists;
+	auto& weights = lookup.weights;
+	auto total = lookup.total;
+	auto minLen = lookup.minLength;
+	uint32_t firstPos = minLen < longLibOffset.size() ? longLibOffset[minLen] : (uint32_t)longLib.size();
+
+	auto& signature = lookup.signature;
+	std::vector<uint32_t> candidates;
+	for (size_t band = 0; band < lshBands; band++)
+	{
+		auto found = lshBuckets[band].find(bandKey(signature, band));
+		if (found != lshBuckets[band].end())
+			for (auto pos : found->second)
+				if (pos >= firstPos)
+					candidates.push_back(pos);
+	}
+	std::sort(candidates.begin(), candidates.end());
+	candidates.erase(std::unique(candidates.begin(), candidates.end()), candidates.end());
+	lshCandidates += candidates.size();
+
+	//the candidates are verified through the posting lists of the query grams, rather than by decoding them and generating their grams:
+	//a bit test for a dense list, a forward search for a sparse one, since both the candidates and the positions are ascending
+	auto arena = localPostings();
+	std::vector<float> hits(candidates.size(), 0);
+	for (size_t i = 0; i < lists.size(); i++)
+	{
+		if (weights[i] == 0 || !lists[i])
+			continue;
+		auto begin = arena + lists[i]->offset;
+		if (lists[i]->dense)
+		{
+			for (size_t c = 0; c < candidates.size(); c++)
+				if (begin[candidates[c] / 32] >> (candidates[c] % 32) & 1)
+					hits[c] += weights[i];
+			continue;
+		}
+		auto end = begin + lists[i]->count;
+		for (size_t c = 0; c < candidates.size() && begin != end; c++)
+		{
+			begin = std::lower_bound(begin, end, candidates[c]);
+			if (begin != end && *begin == candidates[c])
+				hits[c] += weights[i];
+		}
+	}
+	for (size_t c = 0; c < candidates.size(); c++)
+		if (hits[c] > 0)
+			score[longLib[candidates[c]]] = hits[c] / total;
 }
 
 /*!
 Assigns scores to the corresponding keywords
-@param query The query string.
 @param entryScore The result calculated will be merged to this map based on keywords. Key: the keyword's ID, Value: the score
 @param scoreList The score board to be processed. Key: the word's ID, Value: the score
 @param threshold Scores lower than this threshold will be discarded
 */
-void StringSearch::StringIndex::calcScore(std::string& query, std::unordered_map<size_t, float>& entryScore,
+void StringSearch::StringIndex::calcScore(std::unordered_map<size_t, float>& entryScore,
 	std::unordered_map<size_t, float>& scoreList, const float threshold) const
 {
 	for (auto& scorePair : scoreList)
@@ -323,37 +979,250 @@ void StringSearch::StringIndex::calcScore(std::string& query, std::unordered_map
 				auto weightPair = weightDicPair->second.find(keyWord);
 				if (weightPair != weightDicPair->second.end())
 				{
-					auto score = std::max(weightPair->second * scorePair.second, entryScore[keyWord]);
-					//the score is considered perfect greater than 0.999
-					if (scorePair.second > 0.999)
-					{
-						std::string libStr(stringLib[keyWord]);
-						escapeBlank(libStr, validChar);
-						trim(libStr);
-						//On exact match, promote to top
-						if (libStr == query)
-							score = 100;
-					}
-					entryScore[keyWord] = score;
+					//exact matches have been seeded with the top score from exactKeys
+					auto& score = entryScore[keyWord];
+					score = std::max(weightPair->second * scorePair.second, score);
 				}
 			}
 	}
 }
 
+/*!
+Promotes the master keys equal to the query to the top score, 100
+@param query The normalised query string.
+@param entryScore The scores of the keywords to be seeded. Key: the keyword's ID, Value: the score
+@returns Whether the query has exact matches
+*/
+bool StringSearch::StringIndex::seedExact(const std::string& query, std::unordered_map<size_t, float>& entryScore) const
+{
+	std::vector<size_t> keys;
+	if (!findExact(query, &keys))
+		return false;
+	//On exact match, promote to top
+	for (auto key : keys)
+		entryScore[key] = 100;
+	return true;
+}
+
+/*!
+Finds the master keys equal to the query. The keys sharing the hash of the query are normalised again to rule out collisions.
+@param query The normalised query string.
+@param keys Output the master keys equal to the query, or nullptr if only whether there is one is needed
+@returns Whether the query has exact matches
+*/
+bool StringSearch::StringIndex::findExact(const std::string& query, std::vector<size_t>* keys) const
+{
+	if (query.empty())
+		return false;
+	auto exact = exactKeys.find(std::hash<std::string>()(query));
+	if (exact == exactKeys.end())
+		return false;
+	bool found = false;
+	std::string normalized;
+	for (auto key : exact->second)
+	{
+		normalizeKey(key, normalized);
+		if (normalized != query)
+			continue;
+		found = true;
+		if (!keys)
+			break;
+		keys->push_back(key);
+	}
+	return found;
+}
+
 /*!
 The worker function for search
 @param query The query string.
 @param threshold Lowest acceptable match ratio for a string to be included in the results.
 @param limit The maximum number of results to generate.
+@param flags A combination of \p SearchFlags.
 @param result The matching strings to be selected, sorted from highest score to lowest.
 */
-std::vector<std::pair<size_t, float>> StringSearch::StringIndex::_search(const char* query, const float threshold, const uint32_t limit) const
+std::vector<std::pair<size_t, float>> StringSearch::StringIndex::_search(const char* query, const float threshold, const uint32_t limit,
+	const uint32_t flags) const
+{
+	return _search(prepare(query), threshold, limit, flags);
+}
+
+/*!
+Estimates the cost of each strategy for a query from the statistics of the library, i.e. the number and lengths of the strings,
+the lengths of the posting lists of the query grams and the sizes of the LSH buckets, and picks the cheapest for the short and the long strings.
+@param query The query prepared by \p prepare.
+@param threshold Lowest acceptable match ratio for a string to be included in the results.
+@param lookup Output the query grams looked up, to be scored by the strategy picked.
+@param flags A combination of \p SearchFlags.
+*/
+StringSearch::SearchPlan StringSearch::StringIndex::plan(const PreparedQuery& query, const float threshold, GramLookup& lookup,
+	const uint32_t flags) const
+{
+	SearchPlan chosen = SearchPlan();
+	chosen.wildcard = query.wildcard;
+	if (query.wildcard || query.text.empty())
+		return chosen;
+	auto len = query.text.size();
+	chosen.queryLength = (uint32_t)len;
+	chosen.queryGrams = (uint32_t)query.grams.size();
+	chosen.exactOnly = (flags & SearchExactFirst) && findExact(query.text, nullptr);
+	if (chosen.exactOnly)
+		return chosen;
+
+	//a scanned string s scores at most |s| / len, so shorter strings cannot reach the threshold
+	auto scanMin = (size_t)std::max(0.0f, std::ceil(len * threshold - 1e-4f));
+	chosen.scanMinLength = (uint32_t)scanMin;
+	auto blocks = (shortLib.size() + PackedStrings::lanes - 1) / PackedStrings::lanes;
+	if (!shortLib.empty())
+		chosen.shortScanCost = (len <= PackedStrings::maxQuery ? blocks * len * costPackedBlock : shortLib.size() * shortLongest * len * costCell)
+			+ shortLib.size() * costString;
+	if (flags & SearchFixedPlan)
+		chosen.shortStrategy = len < 9 && !shortLib.empty() ? PlanScan : PlanSkip;
+	else
+		chosen.shortStrategy = !shortLib.empty() && scanMin <= shortLongest ? PlanScan : PlanSkip;
+
+	//the length histogram gives the characters and strings a scan of the long strings goes through
+	size_t scanFirst = scanMin < longLibOffset.size() ? longLibOffset[scanMin] : longLib.size();
+	chosen.longScanCost = longLibChars[std::min(scanMin, longLibChars.size() - 1)] * len * costCell + (longLib.size() - scanFirst) * costScanString;
+
+	//the postings of the query grams are assumed to be spread over the lengths as the strings are
+	size_t gramFirst = longLib.size();
+	bool approximate = (flags & SearchApproximate) && !lshBuckets.empty() && query.grams.size() > 0;
+	if (query.grams.size() > 0 && !longLib.empty())
+	{
+		gramWeights(query.grams, lookup);
+		auto& lists = lookup.lists;
+		auto& weights = lookup.weights;
+		auto gramMin = minFeasibleLength(query.grams, weights, threshold);
+		lookup.minLength = gramMin;
+		chosen.gramMinLength = (uint32_t)gramMin;
+		gramFirst = gramMin < longLibOffset.size() ? longLibOffset[gramMin] : longLib.size();
+		auto share = (double)(longLib.size() - gramFirst) / longLib.size();
+		auto words = bitmapWords() - gramFirst / 32;
+		double postings = 0;
+		double missed = 1;
+		bool dense = false;
+		chosen.gramCost = query.grams.size() * costLookup;
+		for (size_t i = 0; i < lists.size(); i++)
+		{
+			if (!lists[i] || weights[i] == 0)
+				continue;
+			postings += lists[i]->count * share;
+			missed *= 1 - (double)lists[i]->count / longLib.size();
+			if (lists[i]->dense)
+			{
+				dense = true;
+				chosen.gramCost += words * costBitmapWord;
+			}
+			else
+				chosen.gramCost += lists[i]->count * share * costPosting;
+		}
+		//the dense lists are accumulated into arrays over the positions
+		if (dense)
+			chosen.gramCost += words * 32 * costBitmapWord;
+		//the strings scored are those hit by any gram, taking the grams as independent
+		chosen.gramCost += (1 - missed) * (longLib.size() - gramFirst) * costString;
+		chosen.postings = (uint64_t)postings;
+
+		//the buckets of the query are looked up, as their sizes vary too much to be estimated, and only if they may be searched.
+		//the signature is kept for the search
+		if (approximate)
+		{
+			lookup.signature = minHash(query.grams);
+			size_t candidates = 0;
+			for (size_t band = 0; band < lshBands; band++)
+			{
+				auto found = lshBuckets[band].find(bandKey(lookup.signature, band));
+				if (found != lshBuckets[band].end())
+					candidates += found->second.size();
+			}
+			chosen.lshCandidates = (uint64_t)(candidates * share);
+			chosen.lshCost = (double)lookup.signature.size() * query.grams.size() * costHash + lshBands * costLookup
+				+ chosen.lshCandidates * (query.grams.size() * costCandidateGram + costString);
+		}
+	}
+
+	if (flags & SearchFixedPlan)
+		chosen.longStrategy = len <= 3 ? PlanScan : approximate ? PlanLsh : PlanGrams;
+	else
+	{
+		//the single gram of a 3 character query only finds the strings containing it, while the scan also finds
+		//the strings a character away, unless they are below the threshold
+		bool gramsComplete = len > 3 || (len == 3 && threshold > 2.0f / 3);
+		auto best = chosen.longScanCost;
+		chosen.longStrategy = PlanScan;
+		if (gramsComplete && chosen.gramCost < best)
+		{
+			chosen.longStrategy = PlanGrams;
+			best = chosen.gramCost;
+		}
+		if (approximate && chosen.lshCost < best)
+			chosen.longStrategy = PlanLsh;
+	}
+	if (chosen.longStrategy == PlanScan ? scanFirst == longLib.size() : gramFirst == longLib.size())
+		chosen.longStrategy = PlanSkip;
+	return chosen;
+}
+
+/*!
+Get the plan \p search would follow for a query, without searching
+@param query The query string.
+@param threshold Lowest acceptable match ratio for a string to be included in the results.
+@param flags A combination of \p SearchFlags.
+*/
+StringSearch::SearchPlan StringSearch::StringIndex::explain(const char* query, const float threshold, const uint32_t flags) const
+{
+	if (!indexed)
+		return SearchPlan();
+	GramLookup lookup;
+	return plan(prepare(query), threshold, lookup, flags);
+}
+
+/*!
+Normalises a query with the validChar set of the library, and generates its n-grams
+@param query The query string.
+*/
+StringSearch::PreparedQuery StringSearch::StringIndex::prepare(const char* query) const
+{
+	PreparedQuery prepared;
+	prepared.text = query;
+	if (prepared.text.size() == 0 || (prepared.text.size() == 1 && prepared.text[0] == '*'))
+	{
+		prepared.wildcard = true;
+		prepared.text.clear();
+		return prepared;
+	}
+	escapeBlank(prepared.text, validChar);
+	trim(prepared.text);
+	toUpper(prepared.text);
+	if (prepared.text.size() >= 3)
+		prepared.grams = getGrams(prepared.text);
+	return prepared;
+}
+
+/*!
+Whether a query prepared by another library can be searched in this one, i.e. both have the same validChar set
+@param other The other library.
+*/
+bool StringSearch::StringIndex::sameNormalization(const StringIndex& other) const
+{
+	return validChar == other.validChar;
+}
+
+/*!
+The worker function for search, on a query already prepared
+@param query The query prepared by \p prepare.
+@param threshold Lowest acceptable match ratio for a string to be included in the results.
+@param limit The maximum number of results to generate.
+@param flags A combination of \p SearchFlags.
+*/
+std::vector<std::pair<size_t, float>> StringSearch::StringIndex::_search(const PreparedQuery& query, const float threshold, const uint32_t limit,
+	const uint32_t flags) const
 {
-	std::string queryStr(query);
 	std::unordered_map<size_t, float> entryScore;
+	queryCount++;
 
 	//wildcard
-	if (queryStr.size() == 0 || (queryStr.size() == 1 && queryStr[0] == '*'))
+	if (query.wildcard)
 	{
 		for (auto& kp : wordMap)
 			for (auto& w : kp.second)
@@ -369,31 +1238,58 @@ std::vector<std::pair<size_t, float>> StringSearch::StringIndex::_search(const c
 	}
 	else
 	{
-		escapeBlank(queryStr, validChar);
-		trim(queryStr);
-		if (queryStr.size() == 0)
+		if (query.text.size() == 0)
 			return std::vector<std::pair<size_t, float>>();
-		toUpper(queryStr);
+		std::string queryStr(query.text);
+		if (seedExact(queryStr, entryScore) && (flags & SearchExactFirst))
+			return rank(entryScore, limit);
 		std::unordered_map<size_t, float> scoreShort(shortLib.size());
 		std::unordered_map<size_t, float> scoreLong(longLib.size());
-		std::vector<std::future<void>> futures;
-		//if the query is long, there is no need to search for short sequences.
-		if (queryStr.size() < 9)
-			futures.emplace_back(
-				std::async(std::launch::async, &StringIndex::searchShort, this, std::ref(queryStr), ref(scoreShort))
-			);
-		futures.emplace_back(
-			std::async(std::launch::async, &StringIndex::searchLong, this, std::ref(queryStr), ref(scoreLong))
-		);
-		for (auto& fu : futures)
-			fu.get();
+		GramLookup lookup;
+		auto queryPlan = plan(query, threshold, lookup, flags);
+		auto searchLongPart = [&]() {
+			if (queryPlan.longStrategy == PlanScan)
+				scanLong(queryStr, queryPlan.scanMinLength, scoreLong, threshold);
+			else if (queryPlan.longStrategy != PlanSkip)
+			{
+				recordStopGrams(lookup);
+				if (queryPlan.longStrategy == PlanGrams)
+					searchLong(lookup, scoreLong);
+				else
+					searchLsh(lookup, scoreLong);
+			}
+		};
+		bool searchShortPart = queryPlan.shortStrategy == PlanScan;
+		//a thread is only started for a short scan that costs more than starting it
+		if ((flags & SearchSingleThread) || !searchShortPart || queryPlan.longStrategy == PlanSkip || queryPlan.shortScanCost < costThread)
+		{
+			if (searchShortPart)
+				searchShort(queryStr, scoreShort);
+			searchLongPart();
+		}
+		else
+		{
+			auto shortSearch = std::async(std::launch::async, &StringIndex::searchShort, this, std::ref(queryStr), ref(scoreShort));
+			searchLongPart();
+			shortSearch.get();
+		}
 
 		//merge scores to entryScore
 		entryScore.reserve(scoreShort.size() + scoreLong.size());
-		calcScore(queryStr, entryScore, scoreShort, threshold);
-		calcScore(queryStr, entryScore, scoreLong, threshold);
+		calcScore(entryScore, scoreShort, threshold);
+		calcScore(entryScore, scoreLong, threshold);
 	}
 
+	return rank(entryScore, limit);
+}
+
+/*!
+Sorts the scored keys, and keeps the top \p limit ones
+@param entryScore The scored keys. Key: the keyword's ID, Value: the score
+@param limit The maximum number of results to generate.
+*/
+std::vector<std::pair<size_t, float>> StringSearch::StringIndex::rank(const std::unordered_map<size_t, float>& entryScore, const uint32_t limit) const
+{
 	std::vector<std::pair<size_t, float>> scoreElems(entryScore.begin(), entryScore.end());
 	auto endIt = scoreElems.end();
 	if (scoreElems.size() > limit)
@@ -403,6 +1299,174 @@ std::vector<std::pair<size_t, float>> StringSearch::StringIndex::_search(const c
 	return scoreElems;
 }
 
+/*!
+Extends the query of a typeahead session and searches for it.
+The gram hits and the edit distance rows of the short strings are carried over from the previous keystrokes,
+so only the new grams and the new query characters are scored.
+@param state The session state, rebuilt if the new query does not extend the previous one.
+@param text The characters typed.
+@param threshold Lowest acceptable match ratio for a string to be included in the results.
+@param limit The maximum number of results to generate.
+*/
+std::vector<std::pair<size_t, float>> StringSearch::StringIndex::_extend(SessionState& state, const char* text, const float threshold,
+	const uint32_t limit) const
+{
+	state.text += text;
+	auto prepared = prepare(state.text.c_str());
+	//wildcards and blank queries carry no state
+	if (prepared.wildcard || prepared.text.size() == 0)
+		return _search(prepared, threshold, limit);
+	std::string queryStr(prepared.text);
+
+	if (state.generation != generation || state.mode != scoringMode || state.maxFrequency != maxGramFrequency
+		|| queryStr.compare(0, state.query.size(), state.query) != 0)
+	{
+		std::string typed(std::move(state.text));
+		state = SessionState();
+		state.text = std::move(typed);
+		state.generation = generation;
+		state.mode = scoringMode;
+		state.maxFrequency = maxGramFrequency;
+	}
+	state.query = queryStr;
+	queryCount++;
+
+	//accumulate the postings of the new grams only
+	if (queryStr.size() >= 3)
+	{
+		auto maxPostings = state.maxFrequency * longLib.size();
+		auto missingIdf = std::log(1.0f + (float)longLib.size());
+		auto arena = localPostings();
+		for (size_t i = state.gramCount; i < queryStr.size() - 2; i++)
+		{
+			auto found = ngrams.find(gramHash(queryStr, i));
+			const PostingList* list = found != ngrams.end() ? &found->second : nullptr;
+			float weight = 1.0f;
+			if (state.mode == GramIdf)
+				weight = list ? list->idf : missingIdf;
+			bool stop = list && list->count > maxPostings;
+			if (!stop)
+				state.totalWeight += weight;
+			else
+			{
+				state.stopWeight += weight;
+				//once a query has a regular gram, its stop grams are no longer scored
+				if (state.totalWeight != 0)
+					continue;
+			}
+			if (!list)
+				continue;
+			auto& hits = stop ? state.stopHits : state.gramHits;
+			forEachPosting(arena, *list, 0, [&](uint32_t pos) { hits[pos] += weight; });
+			postingsVisited += list->count;
+		}
+		state.gramCount = queryStr.size() - 2;
+		if (state.totalWeight != 0)
+			state.stopHits.clear();
+	}
+
+	//the strategies of a fresh search, which the session follows to return the same results
+	GramLookup lookup;
+	auto queryPlan = plan(prepared, threshold, lookup);
+	bool incrementalShort = queryPlan.shortStrategy == PlanScan && queryStr.size() <= PackedStrings::maxQuery;
+
+	//advance the edit distance rows of the short strings by the new characters
+	if (incrementalShort)
+	{
+		if (state.shortDepth == 0)
+			state.shortRows.assign(shortLib.size() * shortStride, 0);
+		std::string buffer;
+		for (size_t i = 0; i < shortLib.size(); i++)
+		{
+			auto& source = stringAt(shortLib[i], buffer);
+			auto row = &state.shortRows[i * shortStride];
+			for (size_t q = state.shortDepth; q < queryStr.size(); q++)
+			{
+				//row[s] is overwritten by the current query character while the previous one is still needed diagonally
+				uint8_t diagonal = row[0];
+				row[0] = (uint8_t)(q + 1);
+				for (size_t s = 0; s < source.size(); s++)
+				{
+					uint8_t cost = queryStr[q] != source[s];
+					uint8_t above = row[s + 1];
+					row[s + 1] = std::min(std::min((uint8_t)(above + 1), (uint8_t)(row[s] + 1)), (uint8_t)(diagonal + cost));
+					diagonal = above;
+				}
+			}
+		}
+		state.shortDepth = queryStr.size();
+	}
+	else
+	{
+		state.shortDepth = 0;
+		std::vector<uint8_t>().swap(state.shortRows);
+	}
+
+	std::unordered_map<size_t, float> scoreShort;
+	std::unordered_map<size_t, float> scoreLong;
+	if (incrementalShort)
+	{
+		scoreShort.reserve(shortLib.size());
+		for (size_t i = 0; i < shortLib.size(); i++)
+		{
+			auto row = &state.shortRows[i * shortStride];
+			auto misMatch = *std::min_element(row, row + stringLength(shortLib[i]) + 1);
+			scoreShort[shortLib[i]] += (float)(queryStr.size() - misMatch) / queryStr.size();
+		}
+	}
+	else if (queryPlan.shortStrategy == PlanScan)
+		getMatchScore(queryStr, scoreShort);
+	//a scan of longLib is only chosen while it is cheap, so its rows are not worth a copy of longLib per session
+	if (queryPlan.longStrategy == PlanScan)
+		scanLong(queryStr, queryPlan.scanMinLength, scoreLong, threshold);
+	else if (queryPlan.longStrategy == PlanGrams)
+	{
+		auto& hits = state.totalWeight != 0 ? state.gramHits : state.stopHits;
+		auto total = state.totalWeight != 0 ? state.totalWeight : state.stopWeight;
+		scoreLong.reserve(hits.size());
+		for (auto& kp : hits)
+			scoreLong[longLib[kp.first]] = kp.second / total;
+	}
+
+	std::unordered_map<size_t, float> entryScore;
+	entryScore.reserve(scoreShort.size() + scoreLong.size());
+	seedExact(queryStr, entryScore);
+	calcScore(entryScore, scoreShort, threshold);
+	calcScore(entryScore, scoreLong, threshold);
+	return rank(entryScore, limit);
+}
+
+/*!
+The typeahead interface function, calls \p _extend
+@param state The session state.
+@param text The characters typed.
+@param results The matching strings to be selected, sorted from highest score to lowest.
+@param scores The scores of \p results, or nullptr if the scores are not needed.
+@param threshold Lowest acceptable match ratio for a string to be included in the results.
+@param limit The maximum number of results to generate.
+*/
+uint32_t StringSearch::StringIndex::extend(SessionState& state, const char* text, char*** results, float** scores,
+	const float threshold, uint32_t limit) const
+{
+	if (!indexed)
+		return 0;
+
+	if (limit == 0)
+		limit = (std::numeric_limits<int32_t>::max)();
+
+	auto result = _extend(state, text, threshold, limit);
+
+	uint32_t size = std::min((uint32_t)result.size(), limit);
+
+	//transform to C ABI using pointers
+	if (scores)
+		*scores = new float[size];
+	*results = resultArray(size, [&](uint32_t i) { return std::make_pair(this, result[i].first); });
+	for (uint32_t i = 0; scores && i < size; i++)
+		(*scores)[i] = result[i].second;
+	return size;
+}
+
 
 /*!
 The search interface function, calls \p _search
@@ -411,8 +1475,9 @@ The search interface function, calls \p _search
 @param size The number of strings in the result array.
 @param threshold Lowest acceptable match ratio for a string to be included in the results.
 @param limit The maximum number of results to generate.
+@param flags A combination of \p SearchFlags.
 */
-uint32_t StringSearch::StringIndex::score(const char* query, char*** results, float** scores, const float threshold, uint32_t limit) const
+uint32_t StringSearch::StringIndex::score(const char* query, char*** results, float** scores, const float threshold, uint32_t limit, const uint32_t flags) const
 {
 	if (!indexed)
 		return 0;
@@ -420,20 +1485,15 @@ uint32_t StringSearch::StringIndex::score(const char* query, char*** results, fl
 	if (limit == 0)
 		limit = (std::numeric_limits<int32_t>::max)();
 
-	auto result = _search(query, threshold, limit);
+	auto result = _search(query, threshold, limit, flags);
 
 	uint32_t size = std::min((uint32_t)result.size(), limit);
 
 	//transform to C ABI using pointers
 	*scores = new float[size];
-	*results = new char*[size];
+	*results = resultArray(size, [&](uint32_t i) { return std::make_pair(this, result[i].first); });
 	for (uint32_t i = 0; i < size; i++)
-	{
-		auto item = result[i].first;
-		auto resStr = stringLib[item].c_str();
-		(*results)[i] = const_cast<char*>(resStr);
 		(*scores)[i] = result[i].second;
-	}
 	return size;
 }
 
@@ -445,8 +1505,9 @@ The search interface function, calls \p _search
 @param size The number of strings in the result array.
 @param threshold Lowest acceptable match ratio for a string to be included in the results.
 @param limit The maximum number of results to generate.
+@param flags A combination of \p SearchFlags.
 */
-uint32_t StringSearch::StringIndex::search(const char* query, char*** results, const float threshold, uint32_t limit) const
+uint32_t StringSearch::StringIndex::search(const char* query, char*** results, const float threshold, uint32_t limit, const uint32_t flags) const
 {
 	if (!indexed)
 		return 0;
@@ -454,17 +1515,113 @@ uint32_t StringSearch::StringIndex::search(const char* query, char*** results, c
 	if (limit == 0)
 		limit = (std::numeric_limits<int32_t>::max)();
 
-	auto result = _search(query, threshold, limit);
+	auto result = _search(query, threshold, limit, flags);
 
 	uint32_t size = std::min((uint32_t)result.size(), limit);
 
 	//transform to C ABI using pointers
-	*results = new char*[size];
+	*results = resultArray(size, [&](uint32_t i) { return std::make_pair(this, result[i].first); });
+	return size;
+}
+
+/*!
+Searches several libraries at once, and merges their results into a single list.
+The query is prepared once per distinct validChar set, and the libraries are searched in parallel.
+@param indexes The libraries to be searched.
+@param weights The multiplier of the scores of each library, or nullptr to weight them equally.
+@param count The number of libraries.
+@param query The query string.
+@param results The matching strings of all libraries, sorted from highest weighted score to lowest.
+@param scores The weighted scores of \p results, or nullptr if the scores are not needed.
+@param sources The position in \p indexes of the library of each result, or nullptr if not needed.
+@param threshold Lowest acceptable match ratio for a string to be included in the results, before weighting.
+@param limit The maximum number of results to generate.
+@param flags A combination of \p SearchFlags.
+*/
+uint32_t StringSearch::StringIndex::searchMulti(const StringIndex* const* indexes, const float* weights, size_t count, const char* query,
+	char*** results, float** scores, uint32_t** sources, const float threshold, uint32_t limit, const uint32_t flags)
+{
+	if (limit == 0)
+		limit = (std::numeric_limits<int32_t>::max)();
+
+	//libraries sharing a validChar set share the prepared query
+	std::vector<PreparedQuery> prepared;
+	std::vector<size_t> preparedOf(count, 0);
+	std::vector<size_t> preparedBy;
+	for (size_t i = 0; i < count; i++)
+	{
+		if (!indexes[i] || !indexes[i]->indexed)
+			continue;
+		size_t found = 0;
+		while (found < preparedBy.size() && !indexes[i]->sameNormalization(*indexes[preparedBy[found]]))
+			found++;
+		if (found == preparedBy.size())
+		{
+			prepared.push_back(indexes[i]->prepare(query));
+			preparedBy.push_back(i);
+		}
+		preparedOf[i] = found;
+	}
+
+	//each library is searched on a thread of its own, so their searches are not split further
+	std::vector<std::vector<std::pair<size_t, float>>> found(count);
+	auto searchOne = [&](size_t i, uint32_t searchFlags) {
+		if (!indexes[i] || !indexes[i]->indexed)
+			return;
+		found[i] = indexes[i]->_search(prepared[preparedOf[i]], threshold, limit, searchFlags);
+		//only the first limit entries are ranked, the rest come in no particular order
+		if (found[i].size() > limit)
+			found[i].resize(limit);
+	};
+	if (count == 1)
+		searchOne(0, flags);
+	else if (count > 1)
+	{
+		std::vector<std::future<void>> futures;
+		for (size_t i = 1; i < count; i++)
+			futures.emplace_back(std::async(std::launch::async, searchOne, i, flags | SearchSingleThread));
+		searchOne(0, flags | SearchSingleThread);
+		for (auto& fu : futures)
+			fu.get();
+	}
+
+	//each library holds only its own top limit, so the global top limit is among them
+	struct Merged
+	{
+		float score;
+		uint32_t source;
+		size_t id;
+		size_t length;
+	};
+	std::vector<Merged> merged;
+	for (size_t i = 0; i < count; i++)
+	{
+		auto weight = weights ? weights[i] : 1.0f;
+		for (auto& item : found[i])
+			merged.push_back({ item.second * weight, (uint32_t)i, item.first, indexes[i]->stringLength(item.first) });
+	}
+	auto endIt = merged.size() > limit ? merged.begin() + limit : merged.end();
+	std::partial_sort(merged.begin(), endIt, merged.end(), [](const Merged& a, const Merged& b) {
+		if (a.score != b.score)
+			return a.score > b.score;
+		if (a.length != b.length)
+			return a.length < b.length;
+		return a.source < b.source;
+	});
+
+	uint32_t size = (uint32_t)(endIt - merged.begin());
+	//transform to C ABI using pointers
+	*results = resultArray(size, [&](uint32_t i) { return std::make_pair(indexes[merged[i].source], merged[i].id); });
+	if (scores)
+		*scores = new float[size];
+	if (sources)
+		*sources = new uint32_t[size];
 	for (uint32_t i = 0; i < size; i++)
 	{
-		auto item = result[i].first;
-		auto resStr = stringLib[item].c_str();
-		(*results)[i] = const_cast<char*>(resStr);
+		if (scores)
+			(*scores)[i] = merged[i].score;
+		if (sources)
+			(*sources)[i] = merged[i].source;
 	}
 	return size;
 }
@@ -473,13 +1630,16 @@ uint32_t StringSearch::StringIndex::search(const char* query, char*** results, c
 Releases a result pointer that have been generated in \p search
 @param results The strings allocated using the \p new operator.
 @param scores The scores allocated using the \p new operator.
+@param sources The sources allocated by \p searchMulti.
 */
-void StringSearch::StringIndex::release(char** results, float* scores) const
+void StringSearch::StringIndex::release(char** results, float* scores, uint32_t* sources)
 {
 	if (results)
 		delete[] results;
 	if (scores)
 		delete[] scores;
+	if (sources)
+		delete[] sources;
 }
 
 /*!
@@ -498,6 +1658,198 @@ uint64_t StringSearch::StringIndex::libSize() const
 	return ngrams.size();
 }
 
+/*!
+Estimates the heap bytes held by the library, as collected by \p collectStats
+*/
+uint64_t StringSearch::StringIndex::memoryUsage() const
+{
+	return builtStats.totalBytes;
+}
+
+/*!
+Get the memory and shape statistics collected when the library was built
+@param stats The statistics to be filled.
+*/
+void StringSearch::StringIndex::indexStats(IndexStats* stats) const
+{
+	*stats = builtStats;
+}
+
+/*!
+Estimates the heap bytes held by the LSH bands, and the number of heap blocks they take
+@param blocks Incremented by the number of heap blocks.
+*/
+uint64_t StringSearch::StringIndex::lshMemory(uint64_t& blocks) const
+{
+	uint64_t bytes = lshBuckets.capacity() * sizeof(lshBuckets[0]);
+	blocks += lshBuckets.empty() ? 0 : 1;
+	for (auto& band : lshBuckets)
+	{
+		bytes += hashMapBytes(band);
+		blocks += 1 + 2 * band.size();
+		for (auto& kp : band)
+			bytes += kp.second.capacity() * sizeof(uint32_t);
+	}
+	return bytes;
+}
+
+/*!
+Walks the library to fill \p builtStats. Called once the library is built, as it is not modified afterwards.
+*/
+void StringSearch::StringIndex::collectStats()
+{
+	IndexStats stats = IndexStats();
+	uint64_t blocks = 0;
+
+	stats.stringLibBytes = stringLib.capacity() * sizeof(std::string);
+	blocks++;
+	for (auto& str : stringLib)
+	{
+		auto bytes = stringBytes(str);
+		stats.stringLibBytes += bytes;
+		blocks += bytes ? 1 : 0;
+	}
+	stats.compressedStrings = compressedStrings;
+	if (compressedStrings)
+	{
+		//the strings as they would be stored whole, i.e. as decoded by setStringPool
+		uint64_t wholeBytes = stringPool.size() * sizeof(std::string), wholeBlocks = 1;
+		for (size_t i = 0; i < stringPool.size(); i++)
+			if (stringPool.length(i) > 15)
+			{
+				wholeBytes += stringPool.length(i) + 1;
+				wholeBlocks++;
+			}
+		stats.stringLibBytes += stringPool.bytes();
+		blocks += 3;
+		auto wholeTotal = wholeBytes + wholeBlocks * blockOverhead;
+		auto pooledTotal = stringPool.bytes() + 3 * blockOverhead;
+		stats.stringPoolSavedBytes = wholeTotal > pooledTotal ? wholeTotal - pooledTotal : 0;
+	}
+
+	stats.postingBytes = hashMapBytes(ngrams) + postingReplicas.capacity() * sizeof(void*);
+	blocks += 2 + ngrams.size() + postingReplicas.size();
+	for (auto& replica : postingReplicas)
+	{
+		//mapped for the arena, so without allocator headers
+		stats.postingBytes += sizeof(FrozenArray<uint32_t>) + replica->bytes();
+		stats.hugePageReplicas += replica->hugePages() ? 1 : 0;
+	}
+	stats.postingReplicas = (uint32_t)postingReplicas.size();
+	std::vector<std::pair<uint32_t, int32_t>> postings;
+	postings.reserve(ngrams.size());
+	for (auto& kp : ngrams)
+	{
+		stats.postings += kp.second.count;
+		stats.denseGrams += kp.second.dense ? 1 : 0;
+		postings.emplace_back(kp.second.count, kp.first);
+	}
+
+	stats.wordMapBytes = hashMapBytes(wordMap);
+	blocks += 1 + 2 * wordMap.size();
+	uint64_t keys = 0;
+	for (auto& kp : wordMap)
+	{
+		stats.wordMapBytes += kp.second.capacity() * sizeof(size_t);
+		keys += kp.second.size();
+	}
+
+	stats.wordWeightBytes = hashMapBytes(wordWeight);
+	blocks += 1 + wordWeight.size();
+	for (auto& kp : wordWeight)
+	{
+		stats.wordWeightBytes += hashMapBytes(kp.second);
+		blocks += 1 + kp.second.size();
+	}
+
+	stats.otherBytes = (longLib.capacity() + shortLib.capacity()) * sizeof(size_t) + longLibOffset.capacity() * sizeof(uint32_t)
+		+ longLibChars.capacity() * sizeof(uint64_t) + hashMapBytes(longMap) + packedShort.bytes() + hashMapBytes(exactKeys);
+	blocks += 7 + longMap.size() + 2 * exactKeys.size();
+	for (auto& kp : longMap)
+	{
+		auto bytes = stringBytes(kp.first);
+		stats.otherBytes += bytes;
+		blocks += bytes ? 1 : 0;
+	}
+	for (auto& kp : exactKeys)
+		stats.otherBytes += kp.second.capacity() * sizeof(size_t);
+
+	stats.lshBytes = lshMemory(blocks);
+	stats.allocatorOverheadBytes = blocks * blockOverhead;
+	stats.totalBytes = stats.stringLibBytes + stats.postingBytes + stats.wordMapBytes + stats.wordWeightBytes + stats.lshBytes
+		+ stats.otherBytes + stats.allocatorOverheadBytes;
+
+	stats.strings = compressedStrings ? stringPool.size() : stringLib.size();
+	stats.shortStrings = shortLib.size();
+	stats.longStrings = longLib.size();
+	stats.keysPerString = wordMap.empty() ? 0.0 : (double)keys / wordMap.size();
+
+	stats.grams = ngrams.size();
+	if (!postings.empty())
+	{
+		auto top = std::min(statsTopGrams, postings.size());
+		std::partial_sort(postings.begin(), postings.begin() + top, postings.end(), std::greater<std::pair<uint32_t, int32_t>>());
+		stats.postingsMax = postings[0].first;
+		for (size_t i = 0; i < top; i++)
+		{
+			auto gram = postings[i].second;
+			auto& heaviest = stats.heaviestGrams[i];
+			heaviest.gram[0] = (char)(gram >> 16);
+			heaviest.gram[1] = (char)(gram >> 8);
+			heaviest.gram[2] = (char)gram;
+			heaviest.gram[3] = '\0';
+			heaviest.postings = postings[i].first;
+		}
+		//percentiles in ascending order of postings, i.e. counted from the end of the descending order
+		auto percentile = [&](double p) {
+			auto rank = postings.size() - 1 - std::min(postings.size() - 1, (size_t)(p * postings.size()));
+			std::nth_element(postings.begin(), postings.begin() + rank, postings.end(), std::greater<std::pair<uint32_t, int32_t>>());
+			return postings[rank].first;
+		};
+		stats.postingsP50 = percentile(0.5);
+		stats.postingsP99 = percentile(0.99);
+	}
+	builtStats = stats;
+}
+
+/*!
+Whether the library has been indexed and can be searched
+*/
+bool StringSearch::StringIndex::isIndexed() const
+{
+	return indexed;
+}
+
+/*!
+Get the query statistics collected so far
+@param stats The statistics to be filled.
+*/
+void StringSearch::StringIndex::searchStats(SearchStats* stats) const
+{
+	stats->queries = queryCount;
+	stats->postingsVisited = postingsVisited;
+	stats->postingsSkipped = postingsSkipped;
+	auto total = stats->postingsVisited + stats->postingsSkipped;
+	stats->skippedRatio = total ? (double)stats->postingsSkipped / total : 0.0;
+	stats->stopGramsSkipped = stopGramsSkipped;
+	stats->stopPostingsSkipped = stopPostingsSkipped;
+	stats->lshCandidates = lshCandidates;
+}
+
+/*!
+Resumes the query statistics from those of an earlier copy of the library, e.g. one evicted to the snapshot it is reloaded from
+@param stats The statistics to resume from
+*/
+void StringSearch::StringIndex::resumeSearchStats(const SearchStats& stats)
+{
+	queryCount += stats.queries;
+	postingsVisited += stats.postingsVisited;
+	postingsSkipped += stats.postingsSkipped;
+	stopGramsSkipped += stats.stopGramsSkipped;
+	stopPostingsSkipped += stats.stopPostingsSkipped;
+	lshCandidates += stats.lshCandidates;
+}
+
 /*!
 Allows the caller to adjust the validChar set
 @param newValidChar The new validChar set to use
@@ -505,6 +1857,54 @@ Allows the caller to adjust the validChar set
 void StringSearch::StringIndex::setValidChar(std::unordered_set<char>& newValidChar)
 {
 	validChar = std::move(newValidChar);
+	//the sessions normalised their text with the old characters
+	generation = newGeneration();
+	buildExactKeys();
+	if (indexed)
+		collectStats();
+}
+
+/*!
+Adjusts the quality/latency trade-off of the n-gram search. Not thread safe: no search may run meanwhile.
+@param mode How the n-gram hits are scored.
+@param maxFrequency Grams found in more than this fraction of the long strings are ignored as stop grams. 1 to keep all grams.
+*/
+void StringSearch::StringIndex::setScoring(ScoringMode mode, float maxFrequency)
+{
+	scoringMode = mode;
+	maxGramFrequency = maxFrequency;
+}
+
+/*!
+Front-codes the strings into \p stringPool, or decodes them back into \p stringLib. While compressed, a string is decoded
+only to be compared to the query by a scan, or to be returned as a result. The ids of the strings are left as they are.
+Not thread safe: no search may run meanwhile, and no result array may point into \p stringLib.
+@param compressed Whether to compress the strings.
+*/
+void StringSearch::StringIndex::setStringPool(bool compressed)
+{
+	if (compressed == compressedStrings)
+		return;
+	if (compressed)
+	{
+		stringPool.encode(stringLib);
+		std::vector<std::string>().swap(stringLib);
+	}
+	else
+	{
+		stringLib.reserve(stringPool.size());
+		std::string buffer;
+		for (size_t i = 0; i < stringPool.size(); i++)
+		{
+			//copied out of the buffer, so that each string is allocated to its size
+			stringPool.decode(i, buffer);
+			stringLib.emplace_back(buffer);
+		}
+		stringPool.clear();
+	}
+	compressedStrings = compressed;
+	if (indexed)
+		collectStats();
 }
 
-#endif
\ No newline at end of file
+#endif